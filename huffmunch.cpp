@@ -4,13 +4,26 @@
 
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
 #include <queue>
-#include <set>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 #include <stdexcept>
+#if defined(__x86_64__) || defined(_M_X64)
+#define RK_SIMD 1
+#include <emmintrin.h>
+#if defined(__GNUC__)
+#define RK_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
 using namespace std;
 
 #include "huffmunch.h"
@@ -21,7 +34,7 @@ const unsigned int MAX_SYMBOL_SIZE = 255;
 // size of integers in header (maximum stream size)
 // 2 bytes = 64 KB maximum output size
 // 3 bytes = 16 MB maximum output size
-static unsigned int header_width = 2;
+const unsigned int DEFAULT_HEADER_WIDTH = 2;
 
 // how many symbols can be combined into a larger one in a single pass (minimum 2)
 // increasing this marginally increases the ability to get over local minima
@@ -30,10 +43,25 @@ static unsigned int header_width = 2;
 // maximum effect is reached around STEP_SIZE 8 where compression gains get lost to estimation noise
 const unsigned int MIN_STEP_SIZE = 2;
 const unsigned int MAX_STEP_SIZE = 16;
-static unsigned int step_size = 3;
+const unsigned int DEFAULT_STEP_SIZE = 3;
+
+// find repeated strings with a suffix array instead of rolling hashes
+// slower than hashing for narrow searches, but allows much wider ones
+const unsigned int MAX_SUFFIX_STEP_SIZE = 64;
 
 // how many attempts can be made in a single pass before minima is assumed (0 for no limit)
-static unsigned int cutoff = 100;
+const unsigned int DEFAULT_CUTOFF = 100;
+
+// how long a compression may search before stopping with its best result so far, in milliseconds (0 for no limit)
+const unsigned int DEFAULT_TIME_LIMIT = 0;
+
+// how many attempts can be evaluated in parallel
+// the result is the same as a single thread, but may do some extra work that gets discarded
+const unsigned int DEFAULT_THREADS = 1;
+
+// bits resolved per lookup by the table-driven decoder (DecodeTable)
+// each level of the table has 2^DECODE_TABLE_BITS entries
+const unsigned int DECODE_TABLE_BITS = 8;
 
 // used big-endian bytes in the bytestream (easier to read in hex debugging tools)
 // but this is configurable:
@@ -55,6 +83,28 @@ typedef uint32_t elem;
 typedef u32string Stri; // string of elem
 const elem EMPTY = ~0U;
 
+// compact string for the munch working data, while there are fewer than 65535 symbols
+typedef u16string Stri16;
+const char16_t EMPTY16 = 0xFFFF;
+
+// elem from either string type, EMPTY16 becomes EMPTY
+inline elem widen(char32_t e) { return e; }
+inline elem widen(char16_t e) { return (e == EMPTY16) ? EMPTY : elem(e); }
+
+// copy between string types, keeping EMPTY
+template <typename S>
+void convert(const Stri& in, S& out)
+{
+	if ((const void*)&in == (const void*)&out) return;
+	out.resize(in.size());
+	for (uint i=0; i<in.size(); ++i) out[i] = typename S::value_type(in[i]); // EMPTY truncates to EMPTY16
+}
+inline void convert(const Stri16& in, Stri& out)
+{
+	out.resize(in.size());
+	for (uint i=0; i<in.size(); ++i) out[i] = widen(in[i]);
+}
+
 //
 // debug output helper
 //
@@ -65,14 +115,74 @@ const unsigned int DBV = HUFFMUNCH_DEBUG_VERIFY;
 const unsigned int DBI = HUFFMUNCH_DEBUG_INTERNAL;
 const unsigned int DBH = HUFFMUNCH_DEBUG_HEADER;
 
+// requires a huffmunch_context named ctx in scope
 #if HUFFMUNCH_DEBUG
-static unsigned int debug_bits = 0;
-static int debug_text = -1;
-#define DEBUG_OUT(bits_,...) { if(debug_bits & (bits_)) { printf(__VA_ARGS__); } }
+#define DEBUG_OUT(bits_,...) { if(ctx.debug_bits & (bits_)) { printf(__VA_ARGS__); } }
 #else
 #define DEBUG_OUT(...) {}
 #endif
 
+//
+// compression context, holds all settings and reusable buffers
+//
+
+struct DecodeTable;
+class ThreadPool;
+
+struct huffmunch_context
+{
+	uint header_width;
+	uint step_size;
+	uint cutoff;
+	uint time_limit;
+	uint thread_count;
+	bool search_suffix;
+	bool warm_start;
+
+	// dictionary from the last compression, for warm_start
+	uint warm_base; // number of single elem symbols it began with
+	vector<Stri> warm_recipes; // the string of symbols that made each symbol added after those
+
+	huffmunch_progress_callback progress;
+	void* progress_user;
+
+	uint debug_bits;
+	int debug_text;
+	bool print_stri_text;
+
+	struct Scratch; // buffers kept between calls to huffmunch_munch
+	Scratch* scratch;
+	DecodeTable* decode_table; // kept between calls to huffmunch_decompress
+	ThreadPool* pool; // for thread_count, shared by compression and decompression
+
+	huffmunch_context() :
+		header_width(DEFAULT_HEADER_WIDTH),
+		step_size(DEFAULT_STEP_SIZE),
+		cutoff(DEFAULT_CUTOFF),
+		time_limit(DEFAULT_TIME_LIMIT),
+		thread_count(DEFAULT_THREADS),
+		search_suffix(false),
+		warm_start(false),
+		warm_base(0),
+		progress(NULL),
+		progress_user(NULL),
+		debug_bits(0),
+		debug_text(-1),
+		print_stri_text(false),
+		scratch(NULL),
+		decode_table(NULL),
+		pool(NULL)
+	{}
+	~huffmunch_context();
+
+	// No copy
+	huffmunch_context& operator=(const huffmunch_context&) = delete;
+	huffmunch_context(const huffmunch_context&) = delete;
+};
+
+// used by the public functions that don't take a context
+static huffmunch_context default_context;
+
 //
 // BitReader and BitWriter for writing a bitstream to a vector<u8>
 //
@@ -112,51 +222,326 @@ public:
 	}
 };
 
+// reorders the bits of a byte between stream order (first bit high) and BITSTREAM_ENDIAN
+struct BitOrder
+{
+	u8 table[256];
+
+	BitOrder()
+	{
+		for (uint b=0; b<256; ++b)
+		{
+			uint r = 0;
+			for (uint i=0; i<8; ++i) r |= ((b >> (BITSTREAM_ENDIAN i)) & 1) << (7-i);
+			table[b] = r;
+		}
+	}
+	u8 operator[](uint b) const { return table[b]; }
+};
+static const BitOrder bit_order;
+
 class BitWriter
 {
 	vector<u8>* v;
-	u8 buffer;
-	uint bit;
+	uint64_t buffer; // bits not yet output, first in the high bit
+	uint bit; // count of bits in buffer
+
+	void output_bytes() // output all whole bytes in buffer
+	{
+		while (bit >= 8)
+		{
+			v->push_back(bit_order[uint(buffer >> 56)]);
+			buffer <<= 8;
+			bit -= 8;
+		}
+	}
 
 public:
 	BitWriter(vector<u8>* v_) : v(v_), buffer(0), bit(0) {}
 
 	void flush() // finish byte
 	{
-		if (bit>0)
-		{
-			v->push_back(buffer);
-			bit = 0;
-		}
+		bit = (bit + 7) & ~7U; // pad with 0 bits
+		output_bytes();
 		buffer = 0;
+		bit = 0;
 	}
 	void write(uint b)
 	{
 		assert(b == (b&1));
-		buffer |= (b << (BITSTREAM_ENDIAN bit));
-		++bit;
-		if (bit >= 8) flush();
+		write(b, 1);
+	}
+	void write(uint bitstream, uint count) // count may be up to 32
+	{
+		assert(count <= 32);
+		if (count < 1) return;
+		if (count < 32) bitstream &= (1U << count) - 1;
+		buffer |= uint64_t(bitstream) << (64 - bit - count);
+		bit += count;
+		if (bit >= 32) output_bytes();
+	}
+};
+
+// open addressing hash map of integer keys with linear probing, no allocation per entry
+// clear() is O(1): a slot is only in use if it has the current generation
+template <typename T, typename V>
+class FlatMap
+{
+	struct Slot
+	{
+		T key;
+		V value;
+		uint gen;
+	};
+	vector<Slot> slots;
+	uint gen;
+	uint used;
+	uint shift; // 64 - log2(slots.size())
+
+	uint home(T key) const { return uint((uint64_t(key) * 0x9E3779B97F4A7C15ULL) >> shift); }
+	bool occupied(uint i) const { return slots[i].gen == gen; }
+
+	// slot with key, or the empty slot where it would go
+	uint probe(T key) const
+	{
+		const uint mask = slots.size() - 1;
+		uint i = home(key);
+		while (occupied(i) && slots[i].key != key) i = (i+1) & mask;
+		return i;
+	}
+
+	void rehash(uint size) // size must be a power of 2
+	{
+		vector<Slot> old;
+		old.swap(slots);
+		const uint old_gen = gen;
+		Slot empty = { T(), V(), 0 };
+		slots.assign(size, empty);
+		gen = 1;
+		used = 0;
+		shift = 64;
+		for (uint s=size; s>1; s>>=1) --shift;
+		for (const Slot& o : old)
+		{
+			if (o.gen != old_gen) continue;
+			uint i = probe(o.key);
+			slots[i] = o;
+			slots[i].gen = gen;
+			++used;
+		}
+	}
+
+public:
+	FlatMap() : gen(1), used(0), shift(64) { rehash(16); }
+
+	uint size() const { return used; }
+
+	void clear()
+	{
+		used = 0;
+		if (++gen == 0) // generation wrapped, reset every slot
+		{
+			for (Slot& sl : slots) sl.gen = 0;
+			gen = 1;
+		}
 	}
-	void write(uint bitstream, uint count)
+
+	// clear, with room for about n entries, shrinking a table left large by earlier use
+	void reset(uint n)
+	{
+		uint size = 16;
+		while (size < (n * 2)) size <<= 1;
+		if (size == slots.size())
+		{
+			clear();
+			return;
+		}
+		vector<Slot>().swap(slots); // release the old table before allocating the new one
+		rehash(size);
+	}
+
+	V* find(T key)
+	{
+		uint i = probe(key);
+		return occupied(i) ? &slots[i].value : NULL;
+	}
+
+	V& operator[](T key) // missing value is added as V()
+	{
+		if (((used + 1) * 2) > slots.size()) rehash(slots.size() * 2);
+		uint i = probe(key);
+		if (!occupied(i))
+		{
+			slots[i].key = key;
+			slots[i].value = V();
+			slots[i].gen = gen;
+			++used;
+		}
+		return slots[i].value;
+	}
+
+	void erase(T key)
 	{
-		while (count > 0)
+		const uint mask = slots.size() - 1;
+		uint i = probe(key);
+		if (!occupied(i)) return;
+		--used;
+		// shift back any following entries that would no longer be found past the gap
+		uint j = i;
+		while (true)
 		{
-			--count;
-			uint b = (bitstream >> count) & 1;
-			write(b);
+			slots[i].gen = 0;
+			while (true)
+			{
+				j = (j+1) & mask;
+				if (!occupied(j)) return;
+				uint k = home(slots[j].key);
+				bool stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+				if (!stays) break;
+			}
+			slots[i] = slots[j];
+			i = j;
 		}
 	}
+
+	class const_iterator
+	{
+		const FlatMap* m;
+		uint i;
+		void skip() { while (i < m->slots.size() && !m->occupied(i)) ++i; }
+	public:
+		const_iterator(const FlatMap* m_, uint i_) : m(m_), i(i_) { skip(); }
+		pair<T,V> operator*() const { return pair<T,V>(m->slots[i].key, m->slots[i].value); }
+		const_iterator& operator++() { ++i; skip(); return *this; }
+		bool operator!=(const const_iterator& o) const { return i != o.i; }
+	};
+	const_iterator begin() const { return const_iterator(this, 0); }
+	const_iterator end() const { return const_iterator(this, slots.size()); }
+};
+
+// set of integer keys
+template <typename T>
+class FlatSet
+{
+	FlatMap<T,bool> m;
+public:
+	void clear() { m.clear(); }
+	void insert(T x) { m[x] = true; }
+	uint count(T x) { return m.find(x) ? 1 : 0; }
 };
 
 // for counting instances of a hash
 template <typename T>
-class Counter : public unordered_map<T,uint>
+class Counter : public FlatMap<T,uint>
 {
 public:
 	void count(T x) { (*this)[x] += 1; } // note: missing value is automatically zero-initialized
 	void count(const vector<T>& s) { for (auto x : s) count(x); }
+	void uncount(T x) // remove one instance, erasing it when none remain
+	{
+		uint* c = this->find(x);
+		assert(c != NULL && *c > 0);
+		if (--(*c) == 0) this->erase(x);
+	}
+};
+
+// runs a batch of jobs on a fixed set of threads
+class ThreadPool
+{
+	vector<thread> threads;
+	mutex m;
+	condition_variable wake; // a new batch is ready
+	condition_variable done; // the batch is finished
+	const function<void(uint)>* job;
+	uint job_count; // jobs in the current batch
+	uint job_next; // next job to start
+	uint job_busy; // jobs started but not finished
+	uint batch; // incremented for each new batch
+	bool quit;
+
+	// take jobs from the current batch until none remain (m must be locked)
+	void work(unique_lock<mutex>& lock)
+	{
+		while (job_next < job_count)
+		{
+			uint j = job_next++;
+			++job_busy;
+			lock.unlock();
+			(*job)(j);
+			lock.lock();
+			--job_busy;
+		}
+		if (job_busy == 0) done.notify_all();
+	}
+
+	void worker()
+	{
+		unique_lock<mutex> lock(m);
+		uint seen = batch;
+		while (true)
+		{
+			wake.wait(lock, [&]{ return quit || batch != seen; });
+			if (quit) return;
+			seen = batch;
+			work(lock);
+		}
+	}
+
+public:
+	// count includes the calling thread
+	ThreadPool(uint count) : job(NULL), job_count(0), job_next(0), job_busy(0), batch(0), quit(false)
+	{
+		for (uint i=1; i<count; ++i) threads.push_back(thread(&ThreadPool::worker, this));
+	}
+
+	uint size() const { return threads.size() + 1; }
+
+	~ThreadPool()
+	{
+		{
+			lock_guard<mutex> lock(m);
+			quit = true;
+		}
+		wake.notify_all();
+		for (thread& t : threads) t.join();
+	}
+
+	// run f(0) to f(count-1), returns when all are finished
+	void run(uint count, const function<void(uint)>& f)
+	{
+		if (threads.size() < 1 || count < 2)
+		{
+			for (uint i=0; i<count; ++i) f(i);
+			return;
+		}
+		unique_lock<mutex> lock(m);
+		job = &f;
+		job_count = count;
+		job_next = 0;
+		++batch;
+		wake.notify_all();
+		work(lock);
+		done.wait(lock, [&]{ return job_next >= job_count && job_busy == 0; });
+	}
+
+	// No copy
+	ThreadPool& operator=(const ThreadPool&) = delete;
+	ThreadPool(const ThreadPool&) = delete;
 };
 
+// the context's thread pool, recreated if thread_count has changed
+ThreadPool& context_pool(huffmunch_context& ctx)
+{
+	const uint thread_count = max(ctx.thread_count,1U);
+	if (ctx.pool == NULL || ctx.pool->size() != thread_count)
+	{
+		delete ctx.pool;
+		ctx.pool = NULL; // in case the new one throws
+		ctx.pool = new ThreadPool(thread_count);
+	}
+	return *ctx.pool;
+}
+
 // variable width integer format, either 8-bit 0-254, or 255,low,high
 uint write_intx(uint x, vector<u8>& output)
 {
@@ -193,8 +578,9 @@ uint read_intx(uint pos, const vector<u8>& packed, uint& out)
 }
 
 // for packing unsigned integers of header_width into the header
-bool pack_header(uint v, uint index, vector<u8>& header)
+bool pack_header(const huffmunch_context& ctx, uint v, uint index, vector<u8>& header)
 {
+	const uint header_width = ctx.header_width;
 	uint ix = index * header_width;
 	if ((ix + header_width) > header.size())
 	{
@@ -216,10 +602,11 @@ bool pack_header(uint v, uint index, vector<u8>& header)
 }
 
 // for unpacking unsigned integers of header_width from the header
-uint unpack_header(uint index, const vector<u8>& header)
+uint unpack_header(const huffmunch_context& ctx, uint index, const u8* header, uint header_size)
 {
+	const uint header_width = ctx.header_width;
 	uint ix = index * header_width;
-	if ((ix + header_width) > header.size())
+	if ((ix + header_width) > header_size)
 	{
 		DEBUG_OUT(DBH,"header not large enough for requested data?\n");
 		return ~0UL;
@@ -234,6 +621,11 @@ uint unpack_header(uint index, const vector<u8>& header)
 	return v;
 }
 
+uint unpack_header(const huffmunch_context& ctx, uint index, const vector<u8>& header)
+{
+	return unpack_header(ctx, index, header.data(), header.size());
+}
+
 inline uint bytesize(uint bits)
 {
 	return (bits+7)/8;
@@ -243,12 +635,11 @@ inline uint bytesize(uint bits)
 
 // print a vector sequence
 // simple heuristic to decide whether to display print_stri as text or integer sequence
-static bool print_stri_text = false;
-
-void print_stri_setup(Stri& v)
+void print_stri_setup(huffmunch_context& ctx, Stri& v)
 {
-	if (debug_text == 0) { print_stri_text = false; return; }
-	if (debug_text == 1) { print_stri_text = true;  return; }
+	bool& print_stri_text = ctx.print_stri_text;
+	if (ctx.debug_text == 0) { print_stri_text = false; return; }
+	if (ctx.debug_text == 1) { print_stri_text = true;  return; }
 
 	print_stri_text = true;
 	if (v.size() == 0) { print_stri_text = false; return; }
@@ -264,13 +655,13 @@ void print_stri_setup(Stri& v)
 	return;
 }
 
-void print_stri(const Stri& v)
+void print_stri(const huffmunch_context& ctx, const Stri& v)
 {
 	printf("[");
 	for (uint i=0; i<v.size(); ++i)
 	{
 		auto c = v[i];
-		if (!print_stri_text)
+		if (!ctx.print_stri_text)
 		{
 			if (i != 0) printf(",");
 			printf("%02X",u8(c));
@@ -285,8 +676,8 @@ void print_stri(const Stri& v)
 
 #else
 
-inline void print_stri_setup(Stri& v) { (void)v; }
-inline void print_tri(const Stri& v) { (void)v; }
+inline void print_stri_setup(huffmunch_context& ctx, Stri& v) { (void)ctx; (void)v; }
+inline void print_stri(const huffmunch_context& ctx, const Stri& v) { (void)ctx; (void)v; }
 
 #endif
 
@@ -302,6 +693,75 @@ struct MunchInput
 	vector<Stri> symbols;
 };
 
+// trie of the reversed symbol strings, for finding which symbols are suffixes of another
+struct SuffixTrie
+{
+	static const uint NONE = ~0U;
+
+	unordered_map<uint,uint> edges; // (node * 256) + byte -> child node
+	vector<uint> terminal; // last symbol added that ends at each node, NONE if none
+	vector<uint> next_terminal; // previous symbol that ends at the same node as each symbol
+	uint symbol_count; // symbols added so far
+
+	void clear()
+	{
+		edges.clear();
+		terminal.assign(1,NONE); // root
+		next_terminal.clear();
+		symbol_count = 0;
+	}
+
+	uint child(uint node, elem c) const
+	{
+		auto it = edges.find((node << 8) | c);
+		return (it == edges.end()) ? NONE : it->second;
+	}
+
+	// add symbols not yet in the trie
+	void update(const vector<Stri>& symbols)
+	{
+		for (; symbol_count < symbols.size(); ++symbol_count)
+		{
+			const Stri& s = symbols[symbol_count];
+			uint node = 0;
+			for (uint i=s.size(); i>0; --i)
+			{
+				assert(s[i-1] < 256);
+				uint next = child(node, s[i-1]);
+				if (next == NONE)
+				{
+					next = terminal.size();
+					if (next >= (1U << 24)) throw runtime_error("Suffix trie unexpectedly large!");
+					terminal.push_back(NONE);
+					edges[(node << 8) | s[i-1]] = next;
+				}
+				node = next;
+			}
+			next_terminal.push_back(terminal[node]);
+			terminal[node] = symbol_count;
+		}
+	}
+
+	SuffixTrie() { clear(); }
+};
+const uint SuffixTrie::NONE;
+
+// a list of symbols, optionally extended by one more without copying the list
+// the trie must be up to date with base, but does not include extra
+struct SymbolList
+{
+	const vector<Stri>& base;
+	const SuffixTrie& trie;
+	const Stri* extra;
+
+	SymbolList(const vector<Stri>& base_, const SuffixTrie& trie_, const Stri* extra_=NULL) : base(base_), trie(trie_), extra(extra_)
+	{
+		assert(trie.symbol_count == base.size());
+	}
+	uint size() const { return base.size() + (extra ? 1 : 0); }
+	const Stri& operator[](uint i) const { return (i < base.size()) ? base[i] : *extra; }
+};
+
 struct MunchSize
 {
 	uint stream_bits; // size of generated bitstream
@@ -317,70 +777,45 @@ struct MunchSize
 
 struct HuffCode
 {
+	static const uint NONE = ~0U;
+
 	uint bitstream;
-	uint count;
+	uint count; // NONE for a symbol not in the tree
 };
 
 struct HuffNode
 {
 	uint count;
-	elem leaf;
-	HuffNode* c0;
-	HuffNode* c1;
-
-	HuffNode(elem leaf_, int count_) : leaf(leaf_), c0(NULL), c1(NULL), count(count_) {}
-	HuffNode(HuffNode* c0_, HuffNode* c1_) : leaf(EMPTY), c0(c0_),  c1(c1_),  count(c0_->count + c1_->count) {}
-
-	struct Compare // Comparator for priority_queue<HuffNode*>
-	{
-		bool operator() (const HuffNode* a, const HuffNode* b) { return a->count > b->count; } 
-	};
+	elem leaf; // EMPTY for a branch
+	uint c0; // children of a branch, index to HuffTree::nodes
+	uint c1;
+	uint bytes; // size of this node and its subtree in the output table, set by huffmunch_tree_bytes
 };
 
+// flat huffman tree, reused between builds to avoid reallocation
 struct HuffTree
 {
-	HuffNode* head;
-	vector<HuffNode*> container;
+	static const uint NONE = ~0U;
+
+	vector<HuffNode> nodes; // leaves sorted by count, followed by branches (children always come before their parent)
+	uint head; // root node, NONE if the tree is empty
+	uint bits; // bits needed to encode the data
 	vector<bool> visited;
 	uint visit_count;
 
-	HuffNode* add(HuffNode n)
-	{
-		HuffNode* p = new HuffNode(n);
-		container.push_back(p);
-		return p;
-	}
-
-	void empty()
-	{
-		for (HuffNode* p : container) { delete p; }
-		container.clear();
-		head = NULL;
-	}
-
-	void reset(const MunchInput& in)
+	void reset(uint symbol_count)
 	{
-		// delete all the old nodes
-		empty();
+		nodes.clear();
+		head = NONE;
+		bits = 0;
 
 		// clear the visited list, expand to current size (no need to free this while iterating)
 		for (uint i=0; i<visited.size(); ++i) visited[i] = false;
-		while (visited.size() < in.symbols.size()) visited.push_back(false);
+		while (visited.size() < symbol_count) visited.push_back(false);
 		visit_count = 0;
 	}
 
-	uint count(elem e) const
-	{
-		for (uint i=0; i<container.size(); ++i) if(container[i]->leaf == e) return container[i]->count;
-		return 0;
-	}
-
-	HuffTree() : head(NULL) {}
-	~HuffTree() { empty(); }
-
-	// No deep-copy
-	HuffTree& operator=(const HuffTree&) = delete;
-	HuffTree(const HuffTree&) = delete;
+	HuffTree() : head(NONE), bits(0), visit_count(0) {}
 };
 
 struct Fixup
@@ -390,144 +825,702 @@ struct Fixup
 };
 
 //
-// Huffman tree encoding
+// Rabin-Karp style rolling hashes of various widths for repeated string detection
 //
 
-// build HuffTree from MunchInput
-void huffman_tree(const MunchInput& in, HuffTree& tree)
-{
-	tree.reset(in);
+const uint RK_PRIME = 467; // rolling hash prime, not a factor of (2^32)-1, "nice" binary representation 111010011
 
-	// count frequencies
-	vector<int> count(in.symbols.size(),0);
-	for (auto c : in.data)
-	{
-		if (c == EMPTY) continue;
-		count[c] += 1;
-	}
+// With a prefix hash of the data, prefix[i] = hash of the first i elements,
+// the hash of the width w string at i is: prefix[i+w] - (prefix[i] * RK_PRIME^w)
+// These kernels compute out[i] = hi[i] - (lo[i] * pw) for n positions,
+// which has no dependency between positions, unlike rolling each hash along the data.
+typedef void (*RkKernel)(const elem* hi, const elem* lo, elem pw, uint n, elem* out);
 
-	// build nodes and put into priority queue
-	priority_queue<HuffNode*,vector<HuffNode*>,HuffNode::Compare> q;
-	for (uint c=0; c<in.symbols.size(); ++c)
-	{
-		int frequency = count[c];
-		if (frequency < 1) continue;
-		tree.visited[c] = true;
-		q.push(tree.add(HuffNode(c,frequency)));
-	}
-	tree.visit_count = q.size();
+static void rk_kernel_scalar(const elem* hi, const elem* lo, elem pw, uint n, elem* out)
+{
+	for (uint i=0; i<n; ++i) out[i] = hi[i] - (lo[i] * pw);
+}
 
-	// build huffman tree
-	while (q.size() > 1)
+#if RK_SIMD
+static void rk_kernel_sse2(const elem* hi, const elem* lo, elem pw, uint n, elem* out)
+{
+	// SSE2 has no 32-bit multiply, so the even and odd lanes are multiplied as 64-bit and recombined
+	const __m128i vpw = _mm_set1_epi32(int(pw));
+	uint i = 0;
+	for (; (i+4)<=n; i+=4)
 	{
-		HuffNode* a = q.top(); q.pop();
-		HuffNode* b = q.top(); q.pop();
-		q.push(tree.add(HuffNode(a,b)));
+		__m128i l = _mm_loadu_si128((const __m128i*)(lo+i));
+		__m128i h = _mm_loadu_si128((const __m128i*)(hi+i));
+		__m128i even = _mm_mul_epu32(l, vpw);
+		__m128i odd = _mm_mul_epu32(_mm_srli_epi64(l, 32), vpw);
+		__m128i m = _mm_unpacklo_epi32(
+			_mm_shuffle_epi32(even, _MM_SHUFFLE(0,0,2,0)),
+			_mm_shuffle_epi32(odd, _MM_SHUFFLE(0,0,2,0)));
+		_mm_storeu_si128((__m128i*)(out+i), _mm_sub_epi32(h, m));
 	}
-
-	assert(q.size() == 1);
-	tree.head = q.top();
+	rk_kernel_scalar(hi+i, lo+i, pw, n-i, out+i);
 }
+#endif
 
-// calculate bits to encode data belonging to subtree (recursive)
-uint huffman_tree_bits_node(const HuffNode* node, uint depth)
+#if RK_AVX2
+__attribute__((target("avx2")))
+static void rk_kernel_avx2(const elem* hi, const elem* lo, elem pw, uint n, elem* out)
 {
-	if (node->leaf != EMPTY) return node->count * depth;
-	assert(node->c0 != NULL);
-	assert(node->c1 != NULL);
-	return huffman_tree_bits_node(node->c0,depth+1) + huffman_tree_bits_node(node->c1,depth+1);
+	const __m256i vpw = _mm256_set1_epi32(int(pw));
+	uint i = 0;
+	for (; (i+8)<=n; i+=8)
+	{
+		__m256i l = _mm256_loadu_si256((const __m256i*)(lo+i));
+		__m256i h = _mm256_loadu_si256((const __m256i*)(hi+i));
+		_mm256_storeu_si256((__m256i*)(out+i), _mm256_sub_epi32(h, _mm256_mullo_epi32(l, vpw)));
+	}
+	rk_kernel_scalar(hi+i, lo+i, pw, n-i, out+i);
 }
+#endif
 
-// calculate bits to encode data belonging to tree
-uint huffman_tree_bits(const HuffTree& tree)
+// best kernel for this CPU
+static RkKernel rk_kernel_select()
 {
-	return huffman_tree_bits_node(tree.head,0);
+	#if RK_AVX2
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) return rk_kernel_avx2;
+	#endif
+	#if RK_SIMD
+		return rk_kernel_sse2;
+	#else
+		return rk_kernel_scalar;
+	#endif
 }
+static const RkKernel rk_kernel = rk_kernel_select();
 
-// encode a bitstream given a huffman code map
-void huffman_encode(const unordered_map<elem,HuffCode>& codes, const Stri& data, vector<u8>& output, vector<uint>& splits)
+const uint RK_BLOCK = 2048; // positions hashed at all widths at once, small enough to stay in cache
+
+struct RollingHash
 {
-	BitWriter bitstream(&output);
-	for (elem c : data)
+	vector<elem> rk[MAX_STEP_SIZE-1]; // hash of the width si+2 string starting at each position
+	Counter<elem> rk_freq[MAX_STEP_SIZE-1]; // count of each hash
+	uint erase[MAX_STEP_SIZE-1]; // RK_PRIME^(si+1), removes the oldest elem from a hash
+	uint width; // widest string hashed
+
+	// position index: every position of rk[si] sorted by hash, then position
+	vector<elem> post_hash[MAX_STEP_SIZE-1]; // hash at each post_pos
+	vector<uint> post_pos[MAX_STEP_SIZE-1];
+	bool post_valid[MAX_STEP_SIZE-1]; // index is up to date with rk[si]
+	vector<uint> radix_count;
+	vector<uint> radix_temp;
+	vector<elem> prefix; // prefix[i] = hash of the first i elements of the data, used by build
+
+	// used by replace to update a valid position index instead of rebuilding it
+	vector<uint> remap; // new position of each old position, ~0 if removed
+	vector<uint> replaced_dist; // distance from each new position to the next replacement symbol
+	vector<pair<elem,uint>> dirty; // recomputed (hash, position)
+	vector<elem> merge_hash;
+	vector<uint> merge_pos;
+
+	RollingHash() : width(0)
 	{
-		if (c == EMPTY)
-		{
-			bitstream.flush(); // finish byte before starting new split
-			splits.push_back(output.size());
-			continue;
-		}
-		HuffCode code = codes.at(c);
-		bitstream.write(code.bitstream, code.count);
+		erase[0] = RK_PRIME;
+		for (uint i=1; i<(MAX_STEP_SIZE-1); ++i)
+			erase[i] = erase[i-1] * RK_PRIME;
+		for (uint i=0; i<(MAX_STEP_SIZE-1); ++i)
+			post_valid[i] = false;
 	}
-	bitstream.flush();
-}
-
-//
-// Huffmunch tree data structure builder
-// (the output manifestation of the huffman tree)
-//
 
-elem best_suffix(elem e, uint overhead, const vector<Stri>& symbols, const vector<bool>& visited)
-{
-	assert(symbols.size() <= visited.size());
+	// build the position index for strings of width si+2, if it is out of date
+	void index(uint si)
+	{
+		assert((si+2) <= width);
+		if (post_valid[si]) return;
+		post_valid[si] = true;
+
+		// 2 pass radix sort by 16 bits of hash, stable so each hash keeps its positions in order
+		const vector<elem>& r = rk[si];
+		const uint n = r.size();
+		vector<uint>& pos = post_pos[si];
+		vector<uint>& temp = radix_temp;
+		vector<uint>& count = radix_count;
+		pos.resize(n);
+		temp.resize(n);
+
+		count.assign((1<<16)+1,0);
+		for (uint i=0; i<n; ++i) ++count[(r[i] & 0xFFFF)+1];
+		for (uint i=1; i<=(1<<16); ++i) count[i] += count[i-1];
+		for (uint i=0; i<n; ++i) temp[count[r[i] & 0xFFFF]++] = i;
+
+		count.assign((1<<16)+1,0);
+		for (uint i=0; i<n; ++i) ++count[(r[i] >> 16)+1];
+		for (uint i=1; i<=(1<<16); ++i) count[i] += count[i-1];
+		for (uint i=0; i<n; ++i) pos[count[r[temp[i]] >> 16]++] = temp[i];
+
+		post_hash[si].resize(n);
+		for (uint i=0; i<n; ++i) post_hash[si][i] = r[pos[i]];
+	}
 
-	const Stri& s = symbols[e];
-	if (s.size() < (overhead+2)) return EMPTY; // too short for suffix
+	// find the increasing positions of strings of width si+2 with the given hash, returns the count
+	// (index(si) must be up to date)
+	uint lookup(uint si, elem hash, const uint*& positions) const
+	{
+		assert(post_valid[si]);
+		const vector<elem>& h = post_hash[si];
+		auto range = equal_range(h.begin(), h.end(), hash);
+		positions = post_pos[si].data() + (range.first - h.begin());
+		return range.second - range.first;
+	}
 
-	// could probably cache this but currently doesn't seem to be the performance bottleneck
-	elem best = EMPTY;
-	uint best_len = overhead;
-	for (elem i=0; i<symbols.size(); ++i)
+	// hash every string of width 2 to width_ in data
+	// one pass builds a prefix hash, then each block of positions is hashed at every width from it
+	template <typename S>
+	void build(const S& data, uint width_)
 	{
-		if (!visited[i]) continue; // symbol has been eliminated from the tree
-		if (i == e) continue; // can't be your own suffix
-		const Stri& ns = symbols[i];
+		width = width_;
+		const uint n = data.size();
+		prefix.resize(n+1);
+		prefix[0] = 0;
+		for (uint i=0; i<n; ++i) prefix[i+1] = (prefix[i] * RK_PRIME) + widen(data[i]);
 
-		if (ns.size() < best_len) continue; // too short
-		if (ns.size() >= s.size()) continue; // too long
+		for (uint ss=2; ss<=width; ++ss)
+		{
+			const uint si = ss-2; // index to rk
+			const uint su = ss-1;
+			const uint rksize = (n >= su) ? (n - su) : 0;
+			rk[si].resize(rksize);
+			rk_freq[si].reset(rk_freq[si].size()); // sized by the distinct hashes of the last build
+			post_valid[si] = false;
+		}
 
-		auto match = std::mismatch(s.begin()+(s.size()-ns.size()),s.end(),ns.begin());
-		if (match.first == s.end() && match.second == ns.end())
+		for (uint b=0; b<n; b+=RK_BLOCK)
 		{
-			best = i;
-			best_len = ns.size();
+			for (uint ss=2; ss<=width; ++ss)
+			{
+				const uint si = ss-2;
+				const uint rksize = rk[si].size();
+				if (b >= rksize) break; // wider strings have fewer positions
+				const uint count = min(RK_BLOCK, rksize-b);
+				elem* r = rk[si].data() + b;
+				rk_kernel(prefix.data()+b+ss, prefix.data()+b, erase[si] * RK_PRIME, count, r);
+				for (uint i=0; i<count; ++i) rk_freq[si].count(r[i]);
+			}
 		}
 	}
-	return best;
-}
-
-//
-// Tree
-//
 
-uint huffmunch_tree_bytes_node(const HuffTree& tree, const HuffNode* node, const vector<Stri>& symbols)
-{
-	if (node->leaf != EMPTY)
+	// update the hashes after every string of width match_width at the (increasing) positions in matches
+	// has been replaced by a single symbol, turning data into next.
+	// only the hashes overlapping a replaced string are recounted,
+	// the rest are just moved to their new position.
+	template <typename S>
+	void replace(const S& data, const S& next, const vector<uint>& matches, uint match_width)
 	{
-		const Stri& s = symbols[node->leaf];
-
-		static_assert(MAX_SYMBOL_SIZE <= 255, "huffmunch tree data structure does not support leaf strings longer than 255 bytes.");
-		assert(s.size() <= MAX_SYMBOL_SIZE);
-
-		// store single byte symbol
-		if (s.size() == 1) return 1 + 1; // 0 to designate single-byte leaf, 1 byte string
-
-		// search for potential suffix strings
-		elem suffix = best_suffix(node->leaf, 2, symbols, tree.visited);
-		if (suffix != EMPTY)
+		assert(match_width >= 2);
+		const uint mu = match_width - 1; // elements removed by each match
+		assert(next.size() + (matches.size() * mu) == data.size());
+
+		// where each position moves, for updating the position indexes still valid
+		bool any_valid = false;
+		for (uint ss=2; ss<=width; ++ss) any_valid |= post_valid[ss-2];
+		if (any_valid)
 		{
-			// 2 to indicate string with suffix reference, 1 byte length, string, 16-bit suffix pointer
-			return 2 + (s.size() - symbols[suffix].size()) + 2;
+			remap.resize(data.size());
+			uint o = 0;
+			uint shift = 0;
+			for (uint k=0; k<=matches.size(); ++k)
+			{
+				const uint end = (k < matches.size()) ? matches[k] : data.size();
+				for (; o<end; ++o) remap[o] = o - shift;
+				if (k >= matches.size()) break;
+				remap[o] = o - shift; ++o; // becomes the replacement symbol
+				for (uint e=1; e<match_width; ++e, ++o) remap[o] = ~0U;
+				shift += mu;
+			}
+
+			replaced_dist.resize(next.size());
+			uint k = matches.size();
+			uint q = ~0U;
+			for (uint n=next.size(); n-- > 0; )
+			{
+				if (k > 0 && (matches[k-1] - ((k-1) * mu)) == n) { q = n; --k; }
+				replaced_dist[n] = (q == ~0U) ? ~0U : (q - n);
+			}
 		}
 
-		// store whole string
+		for (uint ss=2; ss<=width; ++ss)
+		{
+			const uint si = ss-2;
+			const uint su = ss-1;
+			const uint old_size = (data.size() >= su) ? (data.size() - su) : 0;
+			const uint new_size = (next.size() >= su) ? (next.size() - su) : 0;
+			vector<elem>& r = rk[si];
+			Counter<elem>& f = rk_freq[si];
+			assert(r.size() == old_size);
+
+			// uncount the strings that overlapped a match
+			uint done = 0;
+			for (uint p : matches)
+			{
+				uint a = (p >= su) ? (p - su) : 0;
+				uint b = min(p + match_width, old_size);
+				for (uint i=max(a,done); i<b; ++i) f.uncount(r[i]);
+				done = max(done,b);
+			}
+
+			// move the unchanged hashes down, and count the new strings containing each replacement symbol
+			// (moving in place is safe because the source is never behind the destination)
+			uint j = 0;
+			uint shift = 0;
+			for (uint k=0; k<=matches.size(); ++k)
+			{
+				uint clean_end = new_size;
+				uint dirty_end = new_size;
+				if (k < matches.size())
+				{
+					const uint q = matches[k] - shift; // position of replacement in next
+					clean_end = min((q >= su) ? (q - su) : 0, new_size);
+					dirty_end = min(q + 1, new_size);
+				}
+				if (j < clean_end)
+				{
+					std::copy(r.begin()+j+shift, r.begin()+clean_end+shift, r.begin()+j);
+					j = clean_end;
+				}
+				if (j < dirty_end)
+				{
+					elem hash = 0;
+					for (uint i=0; i<ss; ++i)
+					{
+						hash = (hash * RK_PRIME) + widen(next[j+i]);
+					}
+					while (true)
+					{
+						r[j] = hash;
+						f.count(hash);
+						if (++j >= dirty_end) break;
+						hash -= widen(next[j-1]) * erase[si]; // roll off
+						hash = (hash * RK_PRIME) + widen(next[j+su]);
+					}
+				}
+				shift += mu;
+			}
+			r.resize(new_size);
+			if (post_valid[si]) reindex(si, matches, mu);
+		}
+	}
+
+	// update the position index of width si+2 after replace:
+	// unchanged hashes keep their order at their new positions, and the recomputed ones are merged in.
+	// this is linear in the positions, instead of the two radix passes of a rebuild.
+	void reindex(uint si, const vector<uint>& matches, uint mu)
+	{
+		const uint su = si + 1;
+		const vector<elem>& r = rk[si];
+		const uint new_size = r.size();
+
+		dirty.clear();
+		uint done = 0;
+		for (uint k=0; k<matches.size(); ++k)
+		{
+			const uint q = matches[k] - (k * mu); // position of replacement in next
+			const uint a = max((q >= su) ? (q - su) : 0, done);
+			const uint b = min(q + 1, new_size);
+			for (uint i=a; i<b; ++i) dirty.push_back(make_pair(r[i], i));
+			done = max(done, b);
+		}
+		sort(dirty.begin(), dirty.end());
+
+		const vector<elem>& old_hash = post_hash[si];
+		const vector<uint>& old_pos = post_pos[si];
+		merge_hash.clear();
+		merge_pos.clear();
+		merge_hash.reserve(new_size);
+		merge_pos.reserve(new_size);
+		uint d = 0;
+		for (uint i=0; i<old_pos.size(); ++i)
+		{
+			const uint np = remap[old_pos[i]];
+			if (np == ~0U || replaced_dist[np] <= su) continue; // removed, or recomputed
+			const pair<elem,uint> e(old_hash[i], np);
+			assert(r[np] == e.first);
+			for (; d < dirty.size() && dirty[d] < e; ++d)
+			{
+				merge_hash.push_back(dirty[d].first);
+				merge_pos.push_back(dirty[d].second);
+			}
+			merge_hash.push_back(e.first);
+			merge_pos.push_back(e.second);
+		}
+		for (; d < dirty.size(); ++d)
+		{
+			merge_hash.push_back(dirty[d].first);
+			merge_pos.push_back(dirty[d].second);
+		}
+		assert(merge_pos.size() == new_size);
+		post_hash[si].swap(merge_hash);
+		post_pos[si].swap(merge_pos);
+	}
+};
+
+//
+// Suffix array of the munch data, an alternative way to find repeated strings
+//
+
+struct SuffixArray
+{
+	vector<uint> sa; // start of each suffix, in sorted order
+	vector<uint> lcp; // lcp[i] = length of prefix shared by sa[i-1] and sa[i], never including EMPTY
+	vector<uint> rank; // rank[i] = index of the suffix starting at i in sa
+	vector<uint> temp;
+	vector<uint> bucket;
+
+	// prefix doubling with radix sort, then Kasai's LCP
+	template <typename S>
+	void build(const S& data, uint symbol_count)
+	{
+		const uint n = data.size();
+		sa.resize(n);
+		lcp.assign(n,0);
+		rank.resize(n);
+		temp.resize(n);
+		if (n < 1) return;
+
+		// sort by first elem (EMPTY sorts last)
+		uint m = symbol_count + 1; // number of distinct ranks
+		bucket.assign(max(m,n)+1,0);
+		for (uint i=0; i<n; ++i)
+		{
+			rank[i] = (widen(data[i]) == EMPTY) ? symbol_count : widen(data[i]);
+			assert(rank[i] <= symbol_count);
+			++bucket[rank[i]+1];
+		}
+		for (uint i=1; i<=m; ++i) bucket[i] += bucket[i-1];
+		for (uint i=0; i<n; ++i) sa[bucket[rank[i]]++] = i;
+
+		// double the sorted prefix length until every suffix has a unique rank
+		for (uint k=1; ; k<<=1)
+		{
+			// order by the rank at i+k (suffixes with nothing there come first)
+			uint p = 0;
+			for (uint i=(n>k)?(n-k):0; i<n; ++i) temp[p++] = i;
+			for (uint j=0; j<n; ++j) if (sa[j] >= k) temp[p++] = sa[j] - k;
+
+			// stable sort by rank at i
+			for (uint i=0; i<=m; ++i) bucket[i] = 0;
+			for (uint i=0; i<n; ++i) ++bucket[rank[i]+1];
+			for (uint i=1; i<=m; ++i) bucket[i] += bucket[i-1];
+			for (uint j=0; j<n; ++j) sa[bucket[rank[temp[j]]]++] = temp[j];
+
+			// rerank
+			temp[sa[0]] = 0;
+			m = 1;
+			for (uint j=1; j<n; ++j)
+			{
+				const uint a = sa[j-1];
+				const uint b = sa[j];
+				const bool same =
+					rank[a] == rank[b] &&
+					((a+k) < n) == ((b+k) < n) &&
+					((a+k) >= n || rank[a+k] == rank[b+k]);
+				temp[b] = same ? (m-1) : m++;
+			}
+			rank.swap(temp);
+			if (m >= n) break;
+		}
+
+		// longest common prefix of adjacent suffixes, stopping at splits
+		uint h = 0;
+		for (uint i=0; i<n; ++i)
+		{
+			if (rank[i] == 0) { h = 0; continue; }
+			const uint j = sa[rank[i]-1];
+			while ((i+h) < n && (j+h) < n && data[i+h] == data[j+h] && widen(data[i+h]) != EMPTY) ++h;
+			lcp[rank[i]] = h;
+			if (h > 0) --h;
+		}
+	}
+};
+
+// a string repeated in the data, found by the suffix array
+struct Repeat
+{
+	uint begin; // range of its start positions in pool (increasing order)
+	uint end;
+	uint width; // length of the string
+	uint count; // number of non-overlapping occurrences
+};
+
+// list every string of width 2 to max_width that repeats without overlap in the data
+void suffix_repeats(const SuffixArray& sx, uint max_width, vector<uint>& pool, vector<Repeat>& repeats)
+{
+	pool.clear();
+	repeats.clear();
+	const uint n = sx.sa.size();
+
+	// each lcp-interval [lb,rb] of the suffix array holds the suffixes sharing a prefix of length h,
+	// which gives the strings of width parent h+1 to h all occuring at the same positions
+	vector<pair<uint,uint>> stack; // < lcp, left bound >
+	stack.push_back(pair<uint,uint>(0,0));
+	for (uint i=1; i<=n; ++i)
+	{
+		const uint h = (i < n) ? sx.lcp[i] : 0;
+		uint lb = i-1;
+		while (h < stack.back().first)
+		{
+			const pair<uint,uint> top = stack.back();
+			stack.pop_back();
+			lb = top.second;
+			const uint parent = max(h, stack.back().first);
+			const uint w0 = max(parent+1, 2U);
+			const uint w1 = min(top.first, max_width);
+			if (w0 <= w1)
+			{
+				const uint begin = pool.size();
+				pool.insert(pool.end(), sx.sa.begin()+lb, sx.sa.begin()+i);
+				sort(pool.begin()+begin, pool.end());
+				for (uint w=w0; w<=w1; ++w)
+				{
+					uint count = 0;
+					uint next = 0;
+					for (uint k=begin; k<pool.size(); ++k)
+					{
+						if (pool[k] < next) continue;
+						++count;
+						next = pool[k] + w;
+					}
+					if (count < 2) continue;
+					Repeat r = { begin, uint(pool.size()), w, count };
+					repeats.push_back(r);
+				}
+			}
+		}
+		if (h > stack.back().first) stack.push_back(pair<uint,uint>(h,lb));
+	}
+}
+
+// hash the string at data[pos] the same way as RollingHash
+template <typename S>
+elem rk_hash(const S& data, uint pos, uint width)
+{
+	elem hash = 0;
+	for (uint i=0; i<width; ++i) hash = (hash * RK_PRIME) + widen(data[pos+i]);
+	return hash;
+}
+
+// find the non-overlapping occurrences of s among the given increasing candidate positions
+template <typename S>
+void munch_match(const S& data, const S& s, const uint* positions, uint position_count, vector<uint>& matches)
+{
+	matches.clear();
+	uint last = 0; // end of the previous match
+	for (uint k=0; k<position_count; ++k)
+	{
+		const uint p = positions[k];
+		if (p < last) continue; // overlaps the previous match
+		if (data.compare(p, s.size(), s) != 0) continue; // not the same string
+		matches.push_back(p);
+		last = p + s.size();
+	}
+}
+
+// replace the strings of the given width at each of matches with symbol n
+template <typename S>
+void munch_replace(const S& data, uint width, elem n, const vector<uint>& matches, S& next)
+{
+	next.clear();
+	next.reserve(data.size());
+	uint last = 0; // data before this has been copied to next
+	for (uint p : matches)
+	{
+		assert(p >= last);
+		next.append(data, last, p - last);
+		next.push_back(typename S::value_type(n));
+		last = p + width;
+	}
+	next.append(data, last, S::npos);
+}
+
+//
+// Huffman tree encoding
+//
+
+// count frequency of each symbol in MunchInput
+template <typename S>
+void huffman_count(const S& data, uint symbol_count, vector<uint>& count)
+{
+	count.assign(symbol_count,0);
+	for (auto c : data)
+	{
+		if (widen(c) == EMPTY) continue;
+		count[c] += 1;
+	}
+}
+
+void huffman_count(const MunchInput& in, vector<uint>& count)
+{
+	huffman_count(in.data, in.symbols.size(), count);
+}
+
+// build HuffTree from symbol frequencies
+void huffman_tree(const vector<uint>& count, HuffTree& tree)
+{
+	tree.reset(count.size());
+
+	// leaves sorted by frequency
+	vector<HuffNode>& nodes = tree.nodes;
+	for (uint c=0; c<count.size(); ++c)
+	{
+		uint frequency = count[c];
+		if (frequency < 1) continue;
+		tree.visited[c] = true;
+		HuffNode n = { frequency, c, HuffTree::NONE, HuffTree::NONE, 0 };
+		nodes.push_back(n);
+	}
+	const uint leaves = nodes.size();
+	tree.visit_count = leaves;
+	if (leaves < 1) return;
+	sort(nodes.begin(), nodes.end(), [](const HuffNode& a, const HuffNode& b)
+	{
+		return (a.count != b.count) ? (a.count < b.count) : (a.leaf < b.leaf);
+	});
+	nodes.reserve((leaves * 2) - 1);
+
+	// build huffman tree:
+	// branches are created in order of increasing count,
+	// so the two lowest nodes are always at the front of either the leaves or the branches
+	uint ql = 0; // next unused leaf
+	uint qb = leaves; // next unused branch
+	auto lowest = [&]() -> uint
+	{
+		if (ql < leaves && (qb >= nodes.size() || nodes[ql].count <= nodes[qb].count)) return ql++;
+		return qb++;
+	};
+	for (uint i=1; i<leaves; ++i)
+	{
+		uint a = lowest();
+		uint b = lowest();
+		HuffNode n = { nodes[a].count + nodes[b].count, EMPTY, a, b, 0 };
+		nodes.push_back(n);
+		tree.bits += n.count; // each branch adds 1 bit to every symbol beneath it
+	}
+
+	tree.head = nodes.size() - 1;
+}
+
+// build HuffTree from MunchInput
+void huffman_tree(const MunchInput& in, HuffTree& tree)
+{
+	vector<uint> count;
+	huffman_count(in, count);
+	huffman_tree(count, tree);
+}
+
+// calculate bits to encode data belonging to tree
+uint huffman_tree_bits(const HuffTree& tree)
+{
+	return tree.bits;
+}
+
+// encode a bitstream given a huffman code map
+// codes is indexed by symbol, bits is the encoded size from huffman_tree
+void huffman_encode(const vector<HuffCode>& codes, const Stri& data, uint bits, vector<u8>& output, vector<uint>& splits)
+{
+	const uint split_count = count(data.begin(), data.end(), EMPTY);
+	output.reserve(output.size() + bytesize(bits) + split_count); // each split may be padded by up to a byte
+	BitWriter bitstream(&output);
+	for (elem c : data)
+	{
+		if (c == EMPTY)
+		{
+			bitstream.flush(); // finish byte before starting new split
+			splits.push_back(output.size());
+			continue;
+		}
+		assert(c < codes.size() && codes[c].count != HuffCode::NONE);
+		const HuffCode& code = codes[c];
+		bitstream.write(code.bitstream, code.count);
+	}
+	bitstream.flush();
+}
+
+//
+// Huffmunch tree data structure builder
+// (the output manifestation of the huffman tree)
+//
+
+// find the longest visited symbol that is a proper suffix of symbol e, at least overhead long
+// (among identical strings the highest index is chosen)
+elem best_suffix(elem e, uint overhead, const SymbolList& symbols, const vector<bool>& visited)
+{
+	assert(symbols.size() <= visited.size());
+
+	const Stri& s = symbols[e];
+	if (s.size() < (overhead+2)) return EMPTY; // too short for suffix
+
+	// walk the reversed string through the trie, each node passed is a longer suffix
+	const SuffixTrie& trie = symbols.trie;
+	elem best = EMPTY;
+	uint best_len = overhead;
+	uint node = 0;
+	for (uint len=1; len<s.size(); ++len)
+	{
+		node = trie.child(node, s[s.size()-len]);
+		if (node == SuffixTrie::NONE) break;
+		if (len < overhead) continue; // too short
+		for (uint i=trie.terminal[node]; i != SuffixTrie::NONE; i=trie.next_terminal[i])
+		{
+			if (!visited[i]) continue; // symbol has been eliminated from the tree
+			if (i == e) continue; // can't be your own suffix
+			best = i;
+			best_len = len;
+			break;
+		}
+	}
+
+	// the extra symbol is not in the trie, but has the highest index
+	if (symbols.extra)
+	{
+		const elem i = symbols.base.size();
+		const Stri& ns = *symbols.extra;
+		if (i != e && visited[i] &&
+			ns.size() >= best_len && ns.size() < s.size() &&
+			std::equal(ns.begin(), ns.end(), s.end()-ns.size()))
+		{
+			best = i;
+		}
+	}
+	return best;
+}
+
+//
+// Tree
+//
+
+// size of one node in the output table, its children's sizes must already be known
+uint huffmunch_tree_bytes_node(const HuffTree& tree, uint node, const SymbolList& symbols)
+{
+	const HuffNode& n = tree.nodes[node];
+	if (n.leaf != EMPTY)
+	{
+		const Stri& s = symbols[n.leaf];
+
+		static_assert(MAX_SYMBOL_SIZE <= 255, "huffmunch tree data structure does not support leaf strings longer than 255 bytes.");
+		assert(s.size() <= MAX_SYMBOL_SIZE);
+
+		// store single byte symbol
+		if (s.size() == 1) return 1 + 1; // 0 to designate single-byte leaf, 1 byte string
+
+		// search for potential suffix strings
+		elem suffix = best_suffix(n.leaf, 2, symbols, tree.visited);
+		if (suffix != EMPTY)
+		{
+			// 2 to indicate string with suffix reference, 1 byte length, string, 16-bit suffix pointer
+			return 2 + (s.size() - symbols[suffix].size()) + 2;
+		}
+
+		// store whole string
 		return 2 + s.length(); // 1 to indicate string, 1 byte length, string
 	}
 
-	assert(node->c0 != NULL);
-	assert(node->c1 != NULL);
-	uint ta = huffmunch_tree_bytes_node(tree, node->c0, symbols);
-	uint tb = huffmunch_tree_bytes_node(tree, node->c1, symbols);
+	assert(n.c0 < node);
+	assert(n.c1 < node);
+	uint ta = tree.nodes[n.c0].bytes;
+	uint tb = tree.nodes[n.c1].bytes;
 	uint tmin = min(ta,tb); // smaller node goes on left
 	uint skip = tmin + 1; // skip distance is left node + 1 byte to store the distance
 	assert (skip >= 3); // leaf must be at least 2 bytes
@@ -537,36 +1530,42 @@ uint huffmunch_tree_bytes_node(const HuffTree& tree, const HuffNode* node, const
 	return 3 + ta + tb;
 }
 
-uint huffmunch_tree_bytes(const HuffTree& tree, const vector<Stri>& symbols)
+// size every node of the tree bottom-up (children always come before their parent), returns the size of the table
+uint huffmunch_tree_bytes(HuffTree& tree, const SymbolList& symbols)
 {
-	return huffmunch_tree_bytes_node(tree, tree.head, symbols);
+	if (tree.head == HuffTree::NONE) return 0;
+	for (uint i=0; i<tree.nodes.size(); ++i)
+		tree.nodes[i].bytes = huffmunch_tree_bytes_node(tree, i, symbols);
+	return tree.nodes[tree.head].bytes;
 }
 
-void huffmunch_tree_build_node(const HuffTree& tree, const HuffNode* node, const vector<Stri>& symbols,
-	uint depth, uint code, unordered_map<elem,HuffCode>& codes,
+void huffmunch_tree_build_node(const huffmunch_context& ctx, const HuffTree& tree, uint node, const SymbolList& symbols,
+	uint depth, uint code, vector<HuffCode>& codes,
 	vector<Fixup>& fixup, unordered_map<elem,uint>& string_position,
 	vector<u8>& output)
 {
+	const HuffNode& n = tree.nodes[node];
+
 	#if HUFFMUNCH_DEBUG
-	if (debug_bits & DBT)
+	if (ctx.debug_bits & DBT)
 	{
 		for(uint i=0;i<depth;++i) printf("+---"); printf("code %d/%d at %04X",code,depth,output.size());
-		if (node->leaf != EMPTY) 
+		if (n.leaf != EMPTY) 
 		{
 			printf(" ");
-			print_stri(symbols[node->leaf]);
+			print_stri(ctx, symbols[n.leaf]);
 		}
 	}
 	#endif
 
-	if(node->leaf != EMPTY)
+	if(n.leaf != EMPTY)
 	{
 		uint bitstream = code;
 		assert(bitstream <= (1U<<depth)); // can't be more than 2^d leaves at level d
 		HuffCode code = { bitstream, depth };
 
-		elem e = node->leaf;
-		assert(codes.find(e) == codes.end()); // don't add duplicates
+		elem e = n.leaf;
+		assert(codes[e].count == HuffCode::NONE); // don't add duplicates
 		codes[e] = code;
 
 		string_position[e] = output.size();
@@ -614,32 +1613,32 @@ void huffmunch_tree_build_node(const HuffTree& tree, const HuffNode* node, const
 			output.push_back(42); // symbol chosen just to be identifiable
 			output.push_back(43);
 			#if HUFFMUNCH_DEBUG
-			if (debug_bits & DBT)
+			if (ctx.debug_bits & DBT)
 			{
 				printf("-");
-				print_stri(symbols[suffix]);
+				print_stri(ctx, symbols[suffix]);
 			}
 			#endif
 		}
 
-		DEBUG_OUT(DBT," x %d\n",node->count);
+		DEBUG_OUT(DBT," x %d\n",n.count);
 		return;
 	}
 	DEBUG_OUT(DBT,"\n");
 
-	assert(node->c0 != NULL);
-	assert(node->c1 != NULL);
+	assert(n.c0 < node);
+	assert(n.c1 < node);
 
-	// determine size of 2 branches
-	uint ta = huffmunch_tree_bytes_node(tree, node->c0, symbols);
-	uint tb = huffmunch_tree_bytes_node(tree, node->c1, symbols);
+	// size of 2 branches
+	uint ta = tree.nodes[n.c0].bytes;
+	uint tb = tree.nodes[n.c1].bytes;
 
 	// put lowest branch on left
-	const HuffNode* na = node->c0;
-	const HuffNode* nb = node->c1;
+	uint na = n.c0;
+	uint nb = n.c1;
 	if (tb < ta)
 	{
-		const HuffNode* nt = na;
+		uint nt = na;
 		na = nb;
 		nb = nt;
 		uint tt = ta;
@@ -667,21 +1666,24 @@ void huffmunch_tree_build_node(const HuffTree& tree, const HuffNode* node, const
 	uint pa = output.size(); // position of left branch
 	uint pb = pa + ta; // position of right branch
 
-	huffmunch_tree_build_node(tree, na, symbols, depth+1, (code<<1)|0, codes, fixup, string_position, output);
-	assert (output.size() == pb); // verify huffmunch_tree_bytes_node_s size precalculation
-	huffmunch_tree_build_node(tree, nb, symbols, depth+1, (code<<1)|1, codes, fixup, string_position, output);
-	assert (output.size() == pb+tb); // verify huffmunch_tree_bytes_node_s size precalculation
+	huffmunch_tree_build_node(ctx, tree, na, symbols, depth+1, (code<<1)|0, codes, fixup, string_position, output);
+	assert (output.size() == pb); // verify huffmunch_tree_bytes size precalculation
+	huffmunch_tree_build_node(ctx, tree, nb, symbols, depth+1, (code<<1)|1, codes, fixup, string_position, output);
+	assert (output.size() == pb+tb); // verify huffmunch_tree_bytes size precalculation
 
-	assert ((output.size() - p0) == huffmunch_tree_bytes_node(tree,node,symbols));
+	assert ((output.size() - p0) == n.bytes);
 }
 
-void huffmunch_tree_build(const HuffTree& tree, const vector<Stri>& symbols, unordered_map<elem,HuffCode>& codes, vector<u8>& output)
+void huffmunch_tree_build(const huffmunch_context& ctx, HuffTree& tree, const SymbolList& symbols, vector<HuffCode>& codes, vector<u8>& output)
 {
 	uint tree_pos = output.size();
+	uint tree_bytes = huffmunch_tree_bytes(tree, symbols);
+	const HuffCode no_code = { 0, HuffCode::NONE };
+	codes.assign(symbols.size(), no_code);
 
 	vector<Fixup> fixup;
 	unordered_map<elem,uint> string_position;
-	huffmunch_tree_build_node(tree, tree.head, symbols, 0, 0, codes, fixup, string_position, output);
+	huffmunch_tree_build_node(ctx, tree, tree.head, symbols, 0, 0, codes, fixup, string_position, output);
 
 	for (Fixup f : fixup)
 	{
@@ -695,22 +1697,23 @@ void huffmunch_tree_build(const HuffTree& tree, const vector<Stri>& symbols, uno
 		output[f.position+1] = link >> 8;
 	}
 
-	assert((output.size()-tree_pos) == huffmunch_tree_bytes(tree, symbols));
+	assert((output.size()-tree_pos) == tree_bytes);
+	(void)tree_bytes;
 }
 
 // unpacks packed into unpacked, false on error
-bool huffmunch_decode(const vector<u8>& packed, Stri& unpacked)
+bool huffmunch_decode(const huffmunch_context& ctx, const vector<u8>& packed, Stri& unpacked)
 {
 	// header
 	vector<uint> split_start;
 	vector<uint> split_size;
-	uint split_count = unpack_header(0,packed);
+	uint split_count = unpack_header(ctx, 0, packed);
 	for (unsigned int i=0; i<split_count; ++i)
 	{
-		split_start.push_back(unpack_header(1+i, packed));
-		split_size.push_back(unpack_header(1+i+split_count,packed));
+		split_start.push_back(unpack_header(ctx, 1+i, packed));
+		split_size.push_back(unpack_header(ctx, 1+i+split_count, packed));
 	}
-	const uint table_pos = (1 + (split_count * 2)) * header_width;
+	const uint table_pos = (1 + (split_count * 2)) * ctx.header_width;
 
 	BitReader bitstream(&packed);
 
@@ -721,7 +1724,7 @@ bool huffmunch_decode(const vector<u8>& packed, Stri& unpacked)
 		unpacked.push_back(EMPTY);
 		DEBUG_OUT(DBV,"split %d: %04X (%d bytes)\n",s,split_start[s],length);
 		#if HUFFMUNCH_DEBUG
-		if (debug_bits & DBV)
+		if (ctx.debug_bits & DBV)
 		{
 			uint split_end = packed.size();
 			if ((s+1) < split_count) split_end = split_start[s+1];
@@ -822,253 +1825,773 @@ bool huffmunch_decode(const vector<u8>& packed, Stri& unpacked)
 }
 
 //
-// the "muncher" that gradually compresses the data by building up its dictionary
+// table-driven decoder, resolves DECODE_TABLE_BITS of the bitstream per lookup
+// huffmunch_decode is the reference implementation, and this should always match it
 //
 
-// compute the size of the data with a given dictionary
-MunchSize huffmunch_size(const MunchInput& in)
+struct DecodeEntry
 {
-	MunchSize size = {0,0};
-	if (in.data.size() < 1) return size;
-
-	HuffTree tree;
-	huffman_tree(in,tree);
-	size.stream_bits = huffman_tree_bits(tree);
-	size.table_bytes = huffmunch_tree_bytes(tree, in.symbols);
-	return size;
-}
+	uint value; // leaf index, or the first entry of the next level of the table
+	u8 bits; // bits consumed by this entry
+	bool leaf;
+};
 
-MunchInput huffmunch_munch(const Stri& data)
+struct DecodeLeaf
 {
-	const uint data_total = data.size() * 8;
+	uint start; // position in DecodeTable::strings
+	uint length;
+};
 
-	// setup initial best
-	MunchInput best;
-	best.data = data;
-	elem n = 0;
-	for (elem v : data)
+struct DecodeTable
+{
+	static const uint SIZE = 1 << DECODE_TABLE_BITS;
+
+	const u8* packed;
+	uint packed_size;
+	uint split_count;
+	uint header_width;
+	uint tree_end; // the tree is before the first stream
+	uint visits; // nodes visited by fill, more than the tree's size means it isn't a tree
+	bool single_leaf; // a tree of only one leaf needs no bits
+	vector<DecodeEntry> entries; // levels of SIZE entries, beginning with the head of the tree
+	vector<DecodeLeaf> leaves;
+	vector<u8> strings; // every leaf's string with its suffixes already appended
+
+	DecodeTable() : packed(NULL), packed_size(0), split_count(0), header_width(0), tree_end(0), visits(0), single_leaf(false) {}
+
+	uint split_start(const huffmunch_context& ctx, uint s) const { return unpack_header(ctx, 1+s, packed, packed_size); }
+	uint split_size(const huffmunch_context& ctx, uint s) const { return unpack_header(ctx, 1+s+split_count, packed, packed_size); }
+
+	// reads the node at pos, returns false if it or its children are outside the tree, right is 0 for a leaf
+	bool read_node(uint pos, uint& left, uint& right) const
 	{
-		if (v == EMPTY) continue;
-		if (v > n) n = v;
+		if (pos >= tree_end) return false;
+		uint skip = packed[pos];
+		if (skip <= 2)
+		{
+			left = right = 0;
+			return true;
+		}
+		if (skip == 255)
+		{
+			if ((pos+2) >= tree_end) return false;
+			left = pos + 3;
+			right = pos + packed[pos+1] + (packed[pos+2] << 8);
+			if (right < left) return false;
+		}
+		else
+		{
+			left = pos + 1;
+			right = pos + skip;
+		}
+		return right < tree_end; // children always follow their branch
 	}
-	best.symbols.clear();
-	for (elem i=0; i<=n; ++i)
+
+	// appends the leaf at pos and its suffixes to strings, returns its index in leaves
+	bool add_leaf(uint table_pos, uint pos, uint& index)
 	{
-		Stri s;
-		s.push_back(i);
-		best.symbols.push_back(s);
+		DecodeLeaf leaf = { uint(strings.size()), 0 };
+		uint links = 0;
+		while (true)
+		{
+			if ((pos+1) >= tree_end) return false;
+			uint type = packed[pos];
+			if (type == 0)
+			{
+				strings.push_back(packed[pos+1]);
+				break;
+			}
+			if (type > 2) return false; // suffix must be a leaf
+			uint slen = packed[pos+1];
+			if (slen == 0) return false; // string leaves are never empty
+			uint link = pos + 2 + slen;
+			if (link > tree_end) return false;
+			strings.insert(strings.end(), packed + pos + 2, packed + link);
+			if (type == 1) break;
+			if ((link+1) >= tree_end) return false;
+			pos = packed[link+0] + (packed[link+1] << 8) + table_pos;
+			if (++links > tree_end) return false; // suffix loop
+		}
+		leaf.length = strings.size() - leaf.start;
+		// every leaf takes 2 bytes of the tree, and no symbol is longer than MAX_SYMBOL_SIZE
+		if (uint64_t(strings.size()) > (uint64_t(tree_end - table_pos) * MAX_SYMBOL_SIZE)) return false;
+		index = leaves.size();
+		leaves.push_back(leaf);
+		return true;
 	}
-	MunchSize best_size = huffmunch_size(best);
-
-	// buffers for storing Rabin-Karp style hashes of various widths for repeated string detection
-	vector<elem> rk[MAX_STEP_SIZE-1];
-	Counter<elem> rk_freq[MAX_STEP_SIZE-1];
-	const uint RK_PRIME = 467; // rolling hash prime, not a factor of (2^32)-1, "nice" binary representation 111010011
-	uint RK_ERASE[MAX_STEP_SIZE-1] = {RK_PRIME};
-	for (int i=1; i<(MAX_STEP_SIZE-1); ++i)
-		RK_ERASE[i] = RK_ERASE[i-1] * RK_PRIME;
 
-	Stri last_symbol;
-	uint last_bits_saved = 0;
-	uint last_symbol_count = 0;
-	uint last_symbol_len = 0;
-	uint last_attempt = 0;
-	uint last_attempt_size = 0;
-	uint last_visit_count = 0;
-	uint symbols_added = 0;
-	bool minima = false;
-
-	set<pair<elem, uint>> hash_tried;
-	set<Stri> hash_strings;
-
-	DEBUG_OUT(DBM, "Huffmunch step size: %d, cutoff: %d\n", step_size, cutoff);
-	while (!minima)
+	// fill the entries of a level of the table that pass through node after depth bits
+	bool fill(uint table_pos, uint level, uint node, uint depth, uint prefix, vector<pair<uint,uint>>& pending)
 	{
-		// each step:
-		// - analyze current best.data for repeated strings
-		// - make a prioritized list of the repeated strings (guess priority based on frequency/length)
-		// - trial each string until one that decreases the data size is found
-		// - if the data was reduced, repeat the next step
-
-		#if HUFFMUNCH_DEBUG
-		if (debug_bits & DBM)
+		// each node is visited at most twice (again when it begins a level), and takes at least one byte
+		if (++visits > (2 * (tree_end - table_pos))) return false;
+		uint left, right;
+		if (!read_node(node, left, right)) return false;
+		if (right == 0)
 		{
-			printf("%d: %d of %d (%d + %d/%d) => %5.2f%% ",
-				symbols_added, best_size.bytes(), bytesize(data_total), bytesize(best_size.stream_bits), best_size.table_bytes, last_visit_count, (100.0 * best_size) / data_total);
-			printf("%5db/%3d*%1d %4d>%4d ", last_bits_saved, last_symbol_count, last_symbol_len, last_attempt_size, last_attempt);
-			print_stri(last_symbol);
-			printf("\n");
+			uint index;
+			if (!add_leaf(table_pos, node, index)) return false;
+			DecodeEntry e = { index, u8(depth), true };
+			uint span = 1 << (DECODE_TABLE_BITS - depth);
+			for (uint i=0; i<span; ++i) entries[level + (prefix * span) + i] = e;
+			return true;
 		}
-		#endif
+		if (depth >= DECODE_TABLE_BITS)
+		{
+			pending.push_back(make_pair(level + prefix, node)); // continues in another level
+			return true;
+		}
+		return
+			fill(table_pos, level, left,  depth+1, (prefix << 1) | 0, pending) &&
+			fill(table_pos, level, right, depth+1, (prefix << 1) | 1, pending);
+	}
 
-		// generate rolling hash for several string widths, count their frequency
+	// builds the table from the packed data, false if it is not valid
+	bool build(const huffmunch_context& ctx, const u8* packed_, uint packed_size_)
+	{
+		packed = packed_;
+		packed_size = packed_size_;
+		header_width = ctx.header_width;
+		entries.clear();
+		leaves.clear();
+		strings.clear();
+		visits = 0;
+
+		split_count = unpack_header(ctx, 0, packed, packed_size);
+		if (split_count == ~0U) return false;
+		const uint table_pos = (1 + (split_count * 2)) * header_width;
+		if (uint64_t(table_pos) > packed_size) return false;
+		tree_end = packed_size;
+		for (uint s=0; s<split_count; ++s)
+		{
+			uint start = split_start(ctx, s);
+			if (start == ~0U || start < table_pos) return false;
+			tree_end = min(tree_end, start);
+		}
 
-		for (uint ss=2; ss<=step_size; ++ss)
+		uint left, right;
+		if (!read_node(table_pos, left, right)) return false;
+		single_leaf = (right == 0);
+		if (single_leaf)
 		{
-			const uint si = ss-2; // index to rk
-			const uint su = ss-1;
-			const uint erase = RK_ERASE[si];
-			const uint rksize = (best.data.size() >= su) ? (best.data.size() - su) : 0;
-			rk[si].resize(rksize);
-			rk_freq[si].clear();
+			uint index;
+			return add_leaf(table_pos, table_pos, index);
+		}
 
-			elem hash = 0;
-			for (uint i=0; i<su; ++i)
-			{
-				hash = (hash * RK_PRIME) + best.data[i];
-			}
-			for (uint i=0; i<rksize; ++i)
+		vector<pair<uint,uint>> pending; // entry, node
+		pending.push_back(make_pair(~0U, table_pos));
+		while (pending.size())
+		{
+			pair<uint,uint> p = pending.back();
+			pending.pop_back();
+			uint level = entries.size();
+			entries.resize(level + SIZE);
+			if (p.first != ~0U)
 			{
-				hash = (hash * RK_PRIME) + best.data[i+su];
-				rk[si][i] = hash;
-				rk_freq[si].count(hash);
-				hash -= best.data[i] * erase; // roll off
+				DecodeEntry e = { level, u8(DECODE_TABLE_BITS), false };
+				entries[p.first] = e;
 			}
+			if (!fill(table_pos, level, p.second, 0, 0, pending)) return false;
 		}
+		return true;
+	}
 
-		// prioritize hashes by potential bytes replaced (rough estimate of size saved, not accounting for the huffman coding/dictionary)
+	// decode split s into output, which must have room for split_size(s) bytes
+	bool decode(const huffmunch_context& ctx, uint s, u8* output) const
+	{
+		uint length = split_size(ctx, s);
+		uint pos = split_start(ctx, s);
+		if (length == ~0U || pos == ~0U) return false;
 
-		typedef tuple<uint, uint, elem> Task; // < bytes saved, string length, hash >
-		auto task_less = [](const Task& a, const Task& b)
+		if (single_leaf)
 		{
-			return (get<0>(a) != get<0>(b)) ?
-				(get<0>(a) < get<0>(b)) : // favour more bytes saved
-				(get<1>(a) > get<1>(b)) ; // otherwise favour shorter strings
-		};
-		priority_queue<Task, std::vector<Task>, decltype(task_less)> task_queue(task_less);
-		assert(task_queue.empty());
+			const DecodeLeaf& leaf = leaves[0];
+			if (leaf.length < 1 || (length % leaf.length) != 0) return false;
+			for (; length > 0; length -= leaf.length, output += leaf.length)
+				memcpy(output, strings.data() + leaf.start, leaf.length);
+			return true;
+		}
 
-		for (uint ss=2; ss<=step_size; ++ss)
+		uint64_t acc = 0; // next bits of the stream, from the high bit
+		uint acc_bits = 0;
+		while (length > 0)
 		{
-			const uint si = ss-2; // index to rk
-			const uint su = ss-1;
-			for (pair<elem, uint> rkf : rk_freq[si])
+			const DecodeEntry* e;
+			uint level = 0;
+			while (true)
 			{
-				elem hash = rkf.first;
-				uint count = rkf.second;
-				if (count < 1) continue;
-				Task task = Task(count*su, si, hash);
-				if (0 == hash_tried.count(pair<elem,uint>(hash,si)))
+				while (acc_bits <= 56) // reading past the end gives 0 bits, like BitReader
 				{
-					task_queue.push(task);
+					uint b = (pos < packed_size) ? bit_order[packed[pos]] : 0;
+					acc |= uint64_t(b) << (56 - acc_bits);
+					acc_bits += 8;
+					++pos;
 				}
+				e = &entries[level + uint(acc >> (64 - DECODE_TABLE_BITS))];
+				acc <<= e->bits;
+				acc_bits -= e->bits;
+				if (e->leaf) break;
+				level = e->value;
 			}
+			const DecodeLeaf& leaf = leaves[e->value];
+			if (leaf.length > length) return false; // end of data reached prematurely
+			memcpy(output, strings.data() + leaf.start, leaf.length);
+			output += leaf.length;
+			length -= leaf.length;
 		}
+		return true;
+	}
+};
 
-		// trial each task in order of priority
+//
+// the "muncher" that gradually compresses the data by building up its dictionary
+//
 
-		minima = true;
-		last_attempt = 0;
-		last_attempt_size = task_queue.size();
+// compute the size of data with the given symbol frequencies and dictionary
+MunchSize huffmunch_size(const vector<uint>& count, const SymbolList& symbols, HuffTree& tree)
+{
+	MunchSize size = {0,0};
 
-		while (task_queue.size() > 0)
-		{
-			Task task = task_queue.top();
-			task_queue.pop();
-			const uint bsave = get<0>(task);
-			const uint si = get<1>(task);
-			const elem hash = get<2>(task);
-			const uint su = si+1;
-			const uint ss = si+2;
+	huffman_tree(count,tree);
+	if (tree.head == HuffTree::NONE) return size;
+	size.stream_bits = huffman_tree_bits(tree);
+	size.table_bytes = huffmunch_tree_bytes(tree, symbols);
+	return size;
+}
 
-			// hashes can have collisions, so find all strings with this hash
-			hash_strings.clear();
-			for (uint i=su; i<rk[si].size(); ++i)
+// compute the size of the data with a given dictionary
+MunchSize huffmunch_size(const MunchInput& in)
+{
+	if (in.data.size() < 1) return MunchSize(0,0);
+
+	vector<uint> count;
+	HuffTree tree;
+	SuffixTrie trie;
+	huffman_count(in, count);
+	trie.update(in.symbols);
+	return huffmunch_size(count, SymbolList(in.symbols, trie), tree);
+}
+
+typedef tuple<uint, uint, elem, uint> MunchTask; // < bytes saved, string length, hash, repeat index >
+
+// a candidate evaluated by huffmunch_munch
+struct MunchTrial
+{
+	MunchTask task;
+	vector<uint> matches; // positions of the string that would be replaced
+	vector<uint> count; // symbol frequencies after the replacement
+	vector<uint> strings; // positions of the distinct strings with the task's hash
+	HuffTree tree;
+	MunchSize size;
+	Stri symbol; // the last symbol tried
+	Stri source; // the string of symbols it replaces
+	uint symbol_count;
+	bool accept; // next is smaller than the current best
+
+	MunchTrial() : size(0,0), symbol_count(0), accept(false) {}
+};
+
+// buffers kept by huffmunch_context to reuse their allocations
+struct huffmunch_context::Scratch
+{
+	RollingHash hashes;
+	SuffixArray suffixes;
+	vector<uint> repeat_pool;
+	vector<Repeat> repeats;
+	vector<MunchTrial> trials;
+	vector<uint> count;
+	Stri next_data;
+	Stri16 next_data16;
+	SuffixTrie trie;
+
+	Stri& next(const Stri&) { return next_data; }
+	Stri16& next(const Stri16&) { return next_data16; }
+};
+
+huffmunch_context::~huffmunch_context()
+{
+	delete scratch;
+	delete decode_table;
+	delete pool;
+}
+
+// the state of a munch, kept if it has to continue with a wider string type
+struct MunchState
+{
+	uint base_count; // number of single elem symbols it began with
+	vector<Stri> recipes; // the source of each symbol added
+	chrono::steady_clock::time_point deadline;
+};
+
+enum MunchResult
+{
+	MUNCH_DONE,
+	MUNCH_ABORTED, // by the progress callback
+	MUNCH_FULL, // too many symbols for S, best and state are ready to continue with a wider S
+};
+
+// the working data of a munch, best.data itself when it is already the right type
+inline Stri& working_data(MunchInput& best, Stri&) { return best.data; }
+inline Stri16& working_data(MunchInput&, Stri16& compact) { return compact; }
+
+// munch with the working data in a string of type S,
+// if resume is true continue from best and state instead of starting from data
+template <typename S>
+MunchResult huffmunch_munch(huffmunch_context& ctx, const Stri& data, MunchInput& best, MunchState& state, bool resume)
+{
+	typedef typename S::value_type E;
+	const E empty = E(EMPTY); // EMPTY or EMPTY16
+	const uint symbol_limit = uint(empty); // symbol indices must stay below this
+
+	huffmunch_context::Scratch& scratch = *ctx.scratch;
+	const uint step_size = ctx.step_size;
+	const uint cutoff = ctx.cutoff;
+	const bool search_suffix = ctx.search_suffix;
+
+	// stop at the deadline, keeping the best found so far
+	const chrono::steady_clock::time_point deadline = state.deadline;
+	auto expired = [&]() -> bool
+	{
+		return ctx.time_limit && chrono::steady_clock::now() >= deadline;
+	};
+
+	const uint data_total = data.size() * 8;
+
+	S work_compact;
+	S& work = working_data(best, work_compact); // best.data in the form of S
+	vector<uint>& best_count = scratch.count; // frequency of each symbol in work
+	SuffixTrie& trie = scratch.trie; // kept up to date with best.symbols
+	HuffTree tree;
+	uint& base_count = state.base_count;
+	vector<Stri>& recipes = state.recipes;
+	uint symbols_added = 0;
+
+	if (resume)
+	{
+		convert(best.data, work);
+		symbols_added = best.symbols.size() - base_count;
+	}
+	else
+	{
+		// setup initial best
+		convert(data, work);
+		elem n = 0;
+		for (elem v : data)
+		{
+			if (v == EMPTY) continue;
+			if (v > n) n = v;
+		}
+		if (ctx.warm_start && ctx.warm_base > (n+1)) n = ctx.warm_base - 1; // symbol indices must match the warm start dictionary
+		best.symbols.clear();
+		for (elem i=0; i<=n; ++i)
+		{
+			Stri s;
+			s.push_back(i);
+			best.symbols.push_back(s);
+		}
+		base_count = best.symbols.size();
+		recipes.clear();
+	}
+	huffman_count(work, best.symbols.size(), best_count);
+	trie.clear();
+	trie.update(best.symbols);
+	MunchSize best_size = huffmunch_size(best_count, SymbolList(best.symbols, trie), tree);
+
+	// warm start by replaying the last dictionary in order, keeping only the symbols that still help
+	// (only kept symbols are added, and their recipes are renumbered to match)
+	if (ctx.warm_start && !resume)
+	{
+		vector<uint> matches;
+		vector<uint> count;
+		vector<elem> kept(ctx.warm_recipes.size(), EMPTY); // new index of each warm symbol, EMPTY if rejected
+		S& next_data = scratch.next(work);
+		Stri r;
+		S rs;
+		bool stop = false;
+		for (uint w=0; w<ctx.warm_recipes.size(); ++w)
+		{
+			if (expired())
 			{
-				if (rk[si][i] == hash)
+				DEBUG_OUT(DBM,"Time limit reached during warm start.\n");
+				stop = true;
+				break;
+			}
+			if (ctx.progress)
+			{
+				int p = ctx.progress(best_size.bytes(), symbols_added, 0, ctx.progress_user);
+				if (p == HUFFMUNCH_PROGRESS_ABORT)
+				{
+					DEBUG_OUT(DBM,"Aborted by progress callback.\n");
+					return MUNCH_ABORTED;
+				}
+				if (p == HUFFMUNCH_PROGRESS_FINISH)
 				{
-					Stri s = Stri(best.data.c_str()+i,ss);
-					hash_strings.insert(s);
+					DEBUG_OUT(DBM,"Finished by progress callback.\n");
+					stop = true;
+					break;
 				}
 			}
 
-			// try each of these strings
-			for (Stri s : hash_strings)
+			// renumber the single elem symbols if this data has more of them than the last,
+			// and the added symbols to where they were kept
+			r = ctx.warm_recipes[w];
+			bool valid = true;
+			for (auto& e : r)
 			{
-				if (string::npos != s.find(EMPTY)) continue; // don't allow splits to be included in compression
+				if (e < ctx.warm_base) continue;
+				e = kept[e - ctx.warm_base];
+				if (e == EMPTY) valid = false; // a rejected symbol never appears in work
+			}
+			if (!valid) continue;
+			convert(r, rs);
 
-				Stri next_symbol = best.symbols[s[0]];
-				for (uint i=1; i<s.size(); ++i)
-					next_symbol = next_symbol + best.symbols[s[i]];
-				if (next_symbol.size() >= MAX_SYMBOL_SIZE) continue;
-				// really MAX_SYMBOL_SIZE applies to the finished tree symbol, which could be shortened as a prefix
-				// but it's probably "good enough" to enforce this here instead.
+			Stri symbol;
+			for (elem e : r) symbol += best.symbols[e];
 
-				#if HUFFMUNCH_DEBUG
-				if ((debug_bits & DBM) && false) // for debugging all attempts
-				{
-					printf("%4d: %5d (%4d*%1d) %08X ",last_attempt, bsave, bsave/su, ss, hash);
-					print_stri(next_symbol);
-					printf("\n");
-				}
-				#endif
+			matches.clear();
+			for (size_t p = work.find(rs); p != S::npos; p = work.find(rs, p + rs.size()))
+				matches.push_back(p);
+			const uint k = matches.size();
+
+			count.assign(best_count.begin(), best_count.end());
+			count.push_back(k);
+			for (elem e : r) count[e] -= k;
 
-				MunchInput next;
+			MunchSize next_size = best_size;
+			if (k > 0)
+			{
+				try { next_size = huffmunch_size(count, SymbolList(best.symbols, trie, &symbol), tree); }
+				catch (exception e) { DEBUG_OUT(DBM,"skipped warm start symbol: %s\n", e.what()); }
+			}
+			if (!(next_size < best_size)) continue;
+
+			kept[w] = best.symbols.size();
+			munch_replace(work, r.size(), best.symbols.size(), matches, next_data);
+			work.swap(next_data);
+			best_count.swap(count);
+			best_size = next_size;
+			++symbols_added;
+			best.symbols.push_back(symbol);
+			trie.update(best.symbols);
+			recipes.push_back(r);
+		}
+		DEBUG_OUT(DBM,"Warm start: %d of %d symbols kept\n", symbols_added, int(ctx.warm_recipes.size()));
 
-				// add a new symbol to the tree
-				next.symbols = best.symbols;
-				elem n = next.symbols.size();
-				next.symbols.push_back(next_symbol);
+		if (stop)
+		{
+			convert(work, best.data);
+			return MUNCH_DONE;
+		}
+	}
 
-				// create the data, replacing the matched string with the new symbol
-				next.data.reserve(best.data.size());
-				uint i=0;
-				for (; i<rk[si].size(); ++i)
+	// hashes of all short strings in best.data, and their frequency
+	// (built once here, then updated after each accepted symbol)
+	RollingHash& hashes = scratch.hashes;
+	if (!search_suffix) hashes.build(work, min(step_size, MAX_STEP_SIZE));
+	const Counter<elem>* rk_freq = hashes.rk_freq;
+
+	// alternatively, repeated strings found with a suffix array (rebuilt each pass)
+	SuffixArray& suffixes = scratch.suffixes;
+	vector<uint>& repeat_pool = scratch.repeat_pool;
+	vector<Repeat>& repeats = scratch.repeats;
+
+	// evaluates one task, trying each string that has its hash
+	vector<MunchTrial>& trials = scratch.trials;
+	const uint thread_count = max(ctx.thread_count,1U);
+	if (trials.size() != thread_count) trials.resize(thread_count);
+	ThreadPool& pool = context_pool(ctx);
+	function<void(uint)> trial = [&](uint t)
+	{
+		MunchTrial& tr = trials[t];
+		const uint bsave = get<0>(tr.task);
+		const uint si = get<1>(tr.task);
+		const elem hash = get<2>(tr.task);
+		const uint su = si+1;
+		const uint ss = si+2;
+		tr.accept = false;
+
+		vector<uint>& hash_strings = tr.strings; // position of each distinct string
+		hash_strings.clear();
+		const uint* positions; // possible positions of the strings to replace
+		uint position_count;
+		if (search_suffix)
+		{
+			// the suffix array gives the exact string and its positions
+			const Repeat& rp = repeats[get<3>(tr.task)];
+			positions = repeat_pool.data() + rp.begin;
+			position_count = rp.end - rp.begin;
+			hash_strings.push_back(positions[0]);
+		}
+		else
+		{
+			// hashes can have collisions, so find all strings with this hash
+			position_count = hashes.lookup(si, hash, positions);
+			assert(position_count > 0);
+			hash_strings.push_back(positions[0]);
+			for (uint k=1; k<position_count; ++k)
+			{
+				bool found = false;
+				for (uint h : hash_strings) // most will be the same string as the first
 				{
-					const elem o = best.data[i];
-					if(rk[si][i] == hash && Stri(best.data.c_str()+i,ss) == s)
-					{
-						next.data.push_back(n);
-						i += su;
-					}
-					else
-					{
-						next.data.push_back(o);
-					}
+					if (work.compare(positions[k], ss, work, h, ss) == 0) { found = true; break; }
 				}
-				for (; i < best.data.size(); ++i) // trailing bytes of the last unmatched symbol
+				if (!found) hash_strings.push_back(positions[k]);
+			}
+			// try them in string order
+			sort(hash_strings.begin(), hash_strings.end(), [&](uint a, uint b)
+			{
+				return work.compare(a, ss, work, b, ss) < 0;
+			});
+		}
+
+		// try each of these strings
+		for (uint h : hash_strings)
+		{
+			const S s(work, h, ss);
+			if (S::npos != s.find(empty)) continue; // don't allow splits to be included in compression
+
+			Stri next_symbol = best.symbols[s[0]];
+			for (uint i=1; i<s.size(); ++i)
+				next_symbol = next_symbol + best.symbols[s[i]];
+			if (next_symbol.size() >= MAX_SYMBOL_SIZE) continue;
+			// really MAX_SYMBOL_SIZE applies to the finished tree symbol, which could be shortened as a prefix
+			// but it's probably "good enough" to enforce this here instead.
+
+			#if HUFFMUNCH_DEBUG
+			if ((ctx.debug_bits & DBM) && false) // for debugging all attempts
+			{
+				printf("%5d (%4d*%1d) %08X ", bsave, bsave/su, ss, hash);
+				print_stri(ctx, next_symbol);
+				printf("\n");
+			}
+			#endif
+
+			// find the strings to replace with the new symbol
+			munch_match(work, s, positions, position_count, tr.matches);
+			const uint k = tr.matches.size();
+			assert(k > 0);
+
+			// frequencies after replacement, with the new symbol added to the end
+			vector<uint>& count = tr.count;
+			count.assign(best_count.begin(), best_count.end());
+			count.push_back(k);
+			for (elem e : s) count[e] -= k;
+
+			tr.symbol = next_symbol;
+			tr.source.assign(s.begin(), s.end());
+			tr.symbol_count = bsave / su;
+
+			// test the actual finished size of the new data and tree
+			try
+			{
+				MunchSize next_size = huffmunch_size(count, SymbolList(best.symbols, trie, &next_symbol), tr.tree);
+				if (next_size < best_size)
 				{
-					next.data.push_back(best.data[i]);
+					tr.size = next_size;
+					tr.accept = true;
+					return;
 				}
+			}
+			catch (exception e)
+			{
+				DEBUG_OUT(DBM,"skipped attempt: %s\n", e.what());
+			}
+		}
+	};
+
+	Stri last_symbol;
+	uint last_bits_saved = 0;
+	uint last_symbol_count = 0;
+	uint last_symbol_len = 0;
+	uint last_attempt = 0;
+	uint last_attempt_size = 0;
+	uint last_visit_count = 0;
+	bool minima = false;
 
-				last_symbol = next_symbol;
-				last_symbol_count = bsave / su;
-				last_symbol_len = ss;
+	FlatSet<uint64_t> hash_tried; // (string length << 32) | hash
+	auto tried_key = [](elem hash, uint si) -> uint64_t { return (uint64_t(si) << 32) | hash; };
 
-				// test the actual finished size of the new data and tree
-				try
+	DEBUG_OUT(DBM, "Huffmunch step size: %d, cutoff: %d%s\n", step_size, cutoff, search_suffix ? ", suffix search" : "");
+	while (!minima)
+	{
+		// each step:
+		// - analyze current best.data for repeated strings
+		// - make a prioritized list of the repeated strings (guess priority based on frequency/length)
+		// - trial each string until one that decreases the data size is found
+		// - if the data was reduced, repeat the next step
+
+		if (best.symbols.size() >= symbol_limit)
+		{
+			DEBUG_OUT(DBM,"Continuing with wider symbols.\n");
+			convert(work, best.data);
+			return MUNCH_FULL;
+		}
+
+		#if HUFFMUNCH_DEBUG
+		if (ctx.debug_bits & DBM)
+		{
+			printf("%d: %d of %d (%d + %d/%d) => %5.2f%% ",
+				symbols_added, best_size.bytes(), bytesize(data_total), bytesize(best_size.stream_bits), best_size.table_bytes, last_visit_count, (100.0 * best_size) / data_total);
+			printf("%5db/%3d*%1d %4d>%4d ", last_bits_saved, last_symbol_count, last_symbol_len, last_attempt_size, last_attempt);
+			print_stri(ctx, last_symbol);
+			printf("\n");
+		}
+		#endif
+
+		if (ctx.progress)
+		{
+			int p = ctx.progress(best_size.bytes(), symbols_added, last_attempt, ctx.progress_user);
+			if (p == HUFFMUNCH_PROGRESS_ABORT)
+			{
+				DEBUG_OUT(DBM,"Aborted by progress callback.\n");
+				return MUNCH_ABORTED;
+			}
+			if (p == HUFFMUNCH_PROGRESS_FINISH)
+			{
+				DEBUG_OUT(DBM,"Finished by progress callback.\n");
+				break;
+			}
+		}
+
+		// prioritize hashes by potential bytes replaced (rough estimate of size saved, not accounting for the huffman coding/dictionary)
+
+		auto task_less = [](const MunchTask& a, const MunchTask& b)
+		{
+			if (get<0>(a) != get<0>(b)) return get<0>(a) < get<0>(b); // favour more bytes saved
+			if (get<1>(a) != get<1>(b)) return get<1>(a) > get<1>(b); // otherwise favour shorter strings
+			if (get<2>(a) != get<2>(b)) return get<2>(a) > get<2>(b); // finally by hash, so the order doesn't depend on rk_freq's iteration order
+			return get<3>(a) > get<3>(b);
+		};
+		priority_queue<MunchTask, std::vector<MunchTask>, decltype(task_less)> task_queue(task_less);
+		assert(task_queue.empty());
+
+		if (search_suffix)
+		{
+			suffixes.build(work, best.symbols.size());
+			suffix_repeats(suffixes, step_size, repeat_pool, repeats);
+			for (uint r=0; r<repeats.size(); ++r)
+			{
+				const Repeat& rp = repeats[r];
+				const uint si = rp.width-2;
+				const uint su = rp.width-1;
+				elem hash = rk_hash(work, repeat_pool[rp.begin], rp.width);
+				MunchTask task = MunchTask(rp.count*su, si, hash, r);
+				if (0 == hash_tried.count(tried_key(hash,si)))
+				{
+					task_queue.push(task);
+				}
+			}
+		}
+		else
+		{
+			for (uint ss=2; ss<=hashes.width; ++ss)
+			{
+				const uint si = ss-2; // index to rk
+				const uint su = ss-1;
+				for (pair<elem, uint> rkf : rk_freq[si])
 				{
-					MunchSize next_size = huffmunch_size(next);
-					if (next_size < best_size)
+					elem hash = rkf.first;
+					uint count = rkf.second;
+					if (count < 1) continue;
+					MunchTask task = MunchTask(count*su, si, hash, 0);
+					if (0 == hash_tried.count(tried_key(hash,si)))
 					{
-						minima = false;
-						best = next;
-						last_bits_saved = best_size - next_size;
-						best_size = next_size;
-						++symbols_added;
-						break;
+						task_queue.push(task);
 					}
 				}
-				catch (exception e)
+			}
+		}
+
+		// trial each task in order of priority
+		// (with several threads, a batch of tasks is evaluated at once,
+		// but they are accepted or rejected in the same order)
+
+		minima = true;
+		last_attempt = 0;
+		last_attempt_size = task_queue.size();
+
+		while (task_queue.size() > 0)
+		{
+			uint batch = min(uint(trials.size()), uint(task_queue.size()));
+			if (cutoff) batch = min(batch, cutoff - last_attempt);
+			for (uint t=0; t<batch; ++t)
+			{
+				trials[t].task = task_queue.top();
+				task_queue.pop();
+				if (!search_suffix) hashes.index(get<1>(trials[t].task));
+			}
+			pool.run(batch, trial);
+
+			for (uint t=0; t<batch; ++t)
+			{
+				MunchTrial& tr = trials[t];
+				const uint si = get<1>(tr.task);
+				const elem hash = get<2>(tr.task);
+
+				last_symbol = tr.symbol;
+				last_symbol_count = tr.symbol_count;
+				last_symbol_len = si+2;
+
+				if (tr.accept)
 				{
-					DEBUG_OUT(DBM,"skipped attempt %d: %s\n", last_attempt, e.what());
+					// only the accepted trial needs its new data built
+					minima = false;
+					S& next_data = scratch.next(work);
+					munch_replace(work, si+2, best.symbols.size(), tr.matches, next_data);
+					if (!search_suffix) hashes.replace(work, next_data, tr.matches, si+2);
+					work.swap(next_data);
+					best.symbols.push_back(tr.symbol);
+					trie.update(best.symbols);
+					recipes.push_back(tr.source);
+					best_count.swap(tr.count);
+					last_bits_saved = best_size - tr.size;
+					best_size = tr.size;
+					++symbols_added;
+					break;
 				}
-			}
 
-			if (!minima) break;
+				// all strings of this hash have been tried, add it to the exhausted list
+				// (this could be a false positive if the a new symbol causes a hash collision,
+				// but that has low probability and the speed gain by ignoring this seems worthwhile)
+				hash_tried.insert(tried_key(hash,si));
 
-			// all strings of this hash have been tried, add it to the exhausted list
-			// (this could be a false positive if the a new symbol causes a hash collision,
-			// but that has low probability and the speed gain by ignoring this seems worthwhile)
-			hash_tried.insert(pair<elem,uint>(hash,si));
+				++last_attempt;
+			}
 
-			++last_attempt;
+			if (!minima) break;
 			if (cutoff && last_attempt >= cutoff) break;
+			if (expired()) break;
 
 		} // while (task_queue.size() > 0)
+
+		if (expired())
+		{
+			DEBUG_OUT(DBM,"Time limit reached after %d symbols.\n", symbols_added);
+			break;
+		}
 	} // while (minima)
 
-	return best;
+	convert(work, best.data);
+	return MUNCH_DONE;
+}
+
+// returns false if the progress callback aborted
+bool huffmunch_munch(huffmunch_context& ctx, const Stri& data, MunchInput& best)
+{
+	if (ctx.scratch == NULL) ctx.scratch = new huffmunch_context::Scratch();
+	MunchState state;
+	state.deadline = chrono::steady_clock::now() + chrono::milliseconds(ctx.time_limit);
+
+	// the compact working data holds most dictionaries, and continues in full width if one grows too large
+	const bool compact = !ctx.warm_start || (ctx.warm_base + ctx.warm_recipes.size()) < EMPTY16;
+	MunchResult result = compact ? huffmunch_munch<Stri16>(ctx, data, best, state, false) : MUNCH_FULL;
+	if (result == MUNCH_FULL)
+		result = huffmunch_munch<Stri>(ctx, data, best, state, compact);
+	if (result == MUNCH_ABORTED) return false;
+
+	ctx.warm_base = state.base_count;
+	ctx.warm_recipes.swap(state.recipes);
+	return true;
 }
 
 //
@@ -1077,7 +2600,7 @@ MunchInput huffmunch_munch(const Stri& data)
 
 const unsigned int SPLITS_DEFAULT[1] = { 0 };
 
-bool splits_valid(const unsigned int* splits, unsigned int split_count)
+bool splits_valid(const huffmunch_context& ctx, const unsigned int* splits, unsigned int split_count)
 {
 	if (split_count < 1) return false;
 	if (splits[0] != 0)
@@ -1108,11 +2631,34 @@ const char* huffmunch_error_description(int e)
 	case HUFFMUNCH_INTERNAL_ERROR: return "Internal error.";
 	case HUFFMUNCH_INVALID_SPLITS: return "Splits must have increasing order, beginning with 0.";
 	case HUFFMUNCH_HEADER_OVERFLOW: return "Split offset or data size too large for header integer size.";
+	case HUFFMUNCH_ABORTED: return "Compression aborted by progress callback.";
+	case HUFFMUNCH_INVALID_DATA: return "Compressed data is not valid.";
+	case HUFFMUNCH_INVALID_INDEX: return "Split index is not in the compressed data.";
 	default: return "Unknown error value.";
 	}
 }
 
-int huffmunch_compress(
+huffmunch_context* huffmunch_context_create()
+{
+	return new huffmunch_context();
+}
+
+void huffmunch_context_destroy(huffmunch_context* ctx)
+{
+	delete ctx;
+}
+
+void huffmunch_context_copy_warm(huffmunch_context* dst, const huffmunch_context* src)
+{
+	if (dst == NULL) dst = &default_context;
+	if (src == NULL) src = &default_context;
+	if (dst == src) return;
+	dst->warm_base = src->warm_base;
+	dst->warm_recipes = src->warm_recipes;
+}
+
+int huffmunch_compress_ctx(
+	huffmunch_context* ctx_,
 	const unsigned char* data,
 	unsigned int data_size,
 	unsigned char* output,
@@ -1120,12 +2666,13 @@ int huffmunch_compress(
 	const unsigned int *splits,
 	unsigned int split_count)
 {
+	huffmunch_context& ctx = *ctx_;
 	if (splits == NULL)
 	{
 		splits = SPLITS_DEFAULT;
 		split_count = 1;
 	}
-	if (!splits_valid(splits, split_count)) return HUFFMUNCH_INVALID_SPLITS;
+	if (!splits_valid(ctx, splits, split_count)) return HUFFMUNCH_INVALID_SPLITS;
 
 	try
 	{
@@ -1143,13 +2690,14 @@ int huffmunch_compress(
 		for (; s < split_count; ++s) sdata.push_back(EMPTY);
 
 		#if HUFFMUNCH_DEBUG
-		print_stri_setup(sdata);
+		print_stri_setup(ctx, sdata);
 		#endif
 
-		MunchInput best = huffmunch_munch(sdata);
+		MunchInput best;
+		if (!huffmunch_munch(ctx, sdata, best)) return HUFFMUNCH_ABORTED;
 
 		HuffTree tree;
-		unordered_map<elem,HuffCode> codes;
+		vector<HuffCode> codes;
 		vector<u8> packed;
 		vector<uint> packed_splits;
 
@@ -1157,15 +2705,17 @@ int huffmunch_compress(
 		// 1 x split count
 		// split_count x split data offset
 		// split_count x split data size
-		uint prefix_size = ((split_count * 2) + 1) * header_width;
+		uint prefix_size = ((split_count * 2) + 1) * ctx.header_width;
 		for (uint i=0; i<prefix_size; ++i) packed.push_back(44); // reserve space for header
 
+		SuffixTrie trie;
+		trie.update(best.symbols);
 		huffman_tree(best, tree);
-		huffmunch_tree_build(tree, best.symbols, codes, packed);
-		huffman_encode(codes, best.data, packed, packed_splits);
+		huffmunch_tree_build(ctx, tree, SymbolList(best.symbols, trie), codes, packed);
+		huffman_encode(codes, best.data, tree.bits, packed, packed_splits);
 
 		DEBUG_OUT(DBH,"split_count: %d\n",split_count);
-		if (!pack_header(split_count, 0, packed)) return HUFFMUNCH_HEADER_OVERFLOW;
+		if (!pack_header(ctx, split_count, 0, packed)) return HUFFMUNCH_HEADER_OVERFLOW;
 		for (unsigned int i=0; i<split_count; ++i)
 		{
 			uint split_packed_start = packed_splits[i];
@@ -1175,13 +2725,13 @@ int huffmunch_compress(
 			uint split_size = split_end - split_start;
 
 			DEBUG_OUT(DBH,"split %d: %X (%X, %d bytes)\n",i,split_packed_start,split_start,split_size);
-			if (!pack_header(split_packed_start, 1+i, packed)) return HUFFMUNCH_HEADER_OVERFLOW;
-			if (!pack_header(split_size, 1+split_count+i, packed)) return HUFFMUNCH_HEADER_OVERFLOW;
+			if (!pack_header(ctx, split_packed_start, 1+i, packed)) return HUFFMUNCH_HEADER_OVERFLOW;
+			if (!pack_header(ctx, split_size, 1+split_count+i, packed)) return HUFFMUNCH_HEADER_OVERFLOW;
 		}
 
 		#if HUFFMUNCH_DEBUG
 		Stri verify;
-		if (huffmunch_decode(packed, verify))
+		if (huffmunch_decode(ctx, packed, verify))
 		{
 			if (verify != sdata)
 			{
@@ -1194,6 +2744,33 @@ int huffmunch_compress(
 			DEBUG_OUT(DBV,"error: verify unable to decode\n");
 			return HUFFMUNCH_VERIFY_FAIL;
 		}
+
+		// cross-check the table-driven decoder against the reference
+		DecodeTable table;
+		vector<u8> verify_fast(data_size);
+		bool fast_valid = table.build(ctx, packed.data(), packed.size());
+		for (uint i=0; fast_valid && i<split_count; ++i)
+			fast_valid = table.decode(ctx, i, verify_fast.data() + splits[i]);
+		if (!fast_valid || (data_size > 0 && memcmp(verify_fast.data(), data, data_size) != 0))
+		{
+			DEBUG_OUT(DBV,"error: verify failed for table decoder\n");
+			return HUFFMUNCH_VERIFY_FAIL;
+		}
+
+		// cross-check the byte at a time stream decoder
+		huffmunch_stream stream(packed.data(), packed.size(), ctx.header_width);
+		for (uint i=0; i<split_count; ++i)
+		{
+			uint length = stream.load(i);
+			for (uint j=0; j<length; ++j)
+			{
+				if (stream.read() != data[splits[i]+j])
+				{
+					DEBUG_OUT(DBV,"error: verify failed for stream decoder\n");
+					return HUFFMUNCH_VERIFY_FAIL;
+				}
+			}
+		}
 		#endif
 
 		if (packed.size() > output_size)
@@ -1217,32 +2794,86 @@ int huffmunch_compress(
 	return HUFFMUNCH_OK;
 }
 
-int huffmunch_decompress(
+int huffmunch_compress(
+	const unsigned char* data,
+	unsigned int data_size,
+	unsigned char* output,
+	unsigned int& output_size,
+	const unsigned int *splits,
+	unsigned int split_count)
+{
+	return huffmunch_compress_ctx(&default_context, data, data_size, output, output_size, splits, split_count);
+}
+
+int huffmunch_decompress_ctx(
+	huffmunch_context* ctx_,
 	const unsigned char* data,
 	unsigned int data_size,
 	unsigned char* output,
 	unsigned int& output_size)
 {
+	huffmunch_context& ctx = *ctx_;
 	try
 	{
-		vector<u8> packed;
-		for (unsigned int i=0; i<data_size; ++i) packed.push_back(data[i]);
-		assert(packed.size() == data_size);
+		// the size of every split is in the header, so the output can be checked before decoding
+		uint split_count = unpack_header(ctx, 0, data, data_size);
+		if (split_count == ~0U) return HUFFMUNCH_INVALID_DATA;
+		uint64_t total = 0;
+		for (uint i=0; i < split_count; ++i)
+		{
+			uint size = unpack_header(ctx, 1+i+split_count, data, data_size);
+			if (size == ~0U) return HUFFMUNCH_INVALID_DATA;
+			total += size;
+		}
+		if (total > output_size || output == NULL)
+		{
+			if (total > ~0U) return HUFFMUNCH_INVALID_DATA;
+			bool overflow = (total > output_size);
+			output_size = uint(total);
+			return overflow ? HUFFMUNCH_OUTPUT_OVERFLOW : HUFFMUNCH_OK;
+		}
 
-		Stri unpacked;
-		huffmunch_decode(packed, unpacked);
+		// decode each split straight from data into its place in output
+		if (ctx.decode_table == NULL) ctx.decode_table = new DecodeTable();
+		DecodeTable& table = *ctx.decode_table;
+		if (!table.build(ctx, data, data_size)) return HUFFMUNCH_INVALID_DATA;
+		vector<uint> split_pos(split_count);
+		uint pos = 0;
+		for (uint i=0; i < split_count; ++i)
+		{
+			split_pos[i] = pos;
+			pos += table.split_size(ctx, i);
+		}
 
-		unsigned int pos = 0;
-		for (unsigned int i=0; i < unpacked.size(); ++i)
+		// splits are independent, so with thread_count they are decoded in parallel
+		const uint thread_count = max(ctx.thread_count,1U);
+		bool valid = true;
+		if (thread_count < 2 || split_count < 2)
+		{
+			for (uint i=0; valid && i < split_count; ++i)
+				valid = table.decode(ctx, i, output + split_pos[i]);
+		}
+		else
 		{
-			elem v = unpacked[i];
-			if (v != EMPTY)
+			// each job takes a run of splits with about an equal share of the output
+			const uint jobs = min(split_count, thread_count * 4);
+			vector<uint> job_start(jobs + 1, split_count);
+			for (uint i=0, j=0; j < jobs; ++j)
 			{
-				if (output && pos < output_size) output[pos] = v;
-				++pos;
+				uint64_t target = (uint64_t(pos) * j) / jobs;
+				while (i < split_count && split_pos[i] < target) ++i;
+				job_start[j] = i;
 			}
+			vector<char> job_valid(jobs, 1);
+			context_pool(ctx).run(jobs, [&](uint j)
+			{
+				for (uint i=job_start[j]; job_valid[j] && i < job_start[j+1]; ++i)
+					job_valid[j] = table.decode(ctx, i, output + split_pos[i]);
+			});
+			for (char v : job_valid) valid = valid && v;
 		}
-		if (pos > output_size) return HUFFMUNCH_OUTPUT_OVERFLOW;
+		if (!valid) return HUFFMUNCH_INVALID_DATA;
+		output_size = pos;
 	}
 	catch (exception e)
 	{
@@ -1253,22 +2884,200 @@ int huffmunch_decompress(
 	return HUFFMUNCH_OK;
 }
 
-bool huffmunch_configure(unsigned int parameter, unsigned int value)
+int huffmunch_decompress(
+	const unsigned char* data,
+	unsigned int data_size,
+	unsigned char* output,
+	unsigned int& output_size)
+{
+	return huffmunch_decompress_ctx(&default_context, data, data_size, output, output_size);
+}
+
+int huffmunch_decompress_split_ctx(
+	huffmunch_context* ctx_,
+	const unsigned char* data,
+	unsigned int data_size,
+	unsigned int index,
+	unsigned char* output,
+	unsigned int& output_size)
+{
+	huffmunch_context& ctx = *ctx_;
+	try
+	{
+		uint split_count = unpack_header(ctx, 0, data, data_size);
+		if (split_count == ~0U) return HUFFMUNCH_INVALID_DATA;
+		if (index >= split_count) return HUFFMUNCH_INVALID_INDEX;
+		uint size = unpack_header(ctx, 1+index+split_count, data, data_size);
+		if (size == ~0U) return HUFFMUNCH_INVALID_DATA;
+		if (size > output_size || output == NULL)
+		{
+			bool overflow = (size > output_size);
+			output_size = size;
+			return overflow ? HUFFMUNCH_OUTPUT_OVERFLOW : HUFFMUNCH_OK;
+		}
+
+		if (ctx.decode_table == NULL) ctx.decode_table = new DecodeTable();
+		DecodeTable& table = *ctx.decode_table;
+		if (!table.build(ctx, data, data_size)) return HUFFMUNCH_INVALID_DATA;
+		if (!table.decode(ctx, index, output)) return HUFFMUNCH_INVALID_DATA;
+		output_size = size;
+	}
+	catch (exception e)
+	{
+		DEBUG_OUT(DBI,"error: internal error: %s\n",e.what());
+		return HUFFMUNCH_INTERNAL_ERROR;
+	}
+
+	return HUFFMUNCH_OK;
+}
+
+int huffmunch_decompress_split(
+	const unsigned char* data,
+	unsigned int data_size,
+	unsigned int index,
+	unsigned char* output,
+	unsigned int& output_size)
+{
+	return huffmunch_decompress_split_ctx(&default_context, data, data_size, index, output, output_size);
+}
+
+huffmunch_stream::huffmunch_stream(const unsigned char* data_, unsigned int data_size, unsigned int header_width_) :
+	data(data_),
+	data_end(data_ + data_size),
+	header_width(header_width_),
+	node(data_end),
+	stream(data_end),
+	tree(data_end),
+	byte(0),
+	status(0),
+	length(0)
+{}
+
+unsigned char huffmunch_stream::at(const unsigned char* p) const
+{
+	return (p >= data && p < data_end) ? *p : 0;
+}
+
+unsigned int huffmunch_stream::count() const
+{
+	uint v = 0;
+	for (uint i=0; i<header_width; ++i) v |= at(data+i) << (8*i);
+	return v;
+}
+
+unsigned int huffmunch_stream::load(unsigned int index)
+{
+	// the same steps as huffmunch_load, for any header width
+	const uint split_count = count();
+	node = stream = tree = data_end;
+	byte = status = length = 0;
+	if (index >= split_count || (uint64_t(1 + (split_count * 2)) * header_width) > uint64_t(data_end - data)) return 0;
+
+	uint start = 0;
+	uint size = 0;
+	const u8* hs = data + ((1 + index) * header_width);
+	const u8* hl = data + ((1 + index + split_count) * header_width);
+	for (uint i=0; i<header_width; ++i)
+	{
+		start |= at(hs+i) << (8*i);
+		size  |= at(hl+i) << (8*i);
+	}
+	tree = data + ((1 + (split_count * 2)) * header_width);
+	stream = (start <= uint(data_end - data)) ? data + start : data_end;
+	return size;
+}
+
+unsigned char huffmunch_stream::read()
+{
+	// emit_byte
+	if (length)
+	{
+		--length;
+		return at(node++);
+	}
+
+	// string_empty
+	uint type;
+	if (status & 0x80)
+	{
+		// follow suffix
+		node = tree + (at(node+0) | (at(node+1) << 8));
+		type = at(node);
+		if (type != 2) status &= 0x7F; // no more suffix
+	}
+	else
+	{
+		// walk_tree
+		node = tree;
+		while ((type = at(node)) >= 3)
+		{
+			if ((status & 7) == 0)
+			{
+				status |= 8;
+				byte = at(stream++);
+			}
+			--status;
+			uint bit = (byte >> (BITSTREAM_ENDIAN (7 - (status & 7)))) & 1;
+			if (bit)
+			{
+				if (type == 255) node += at(node+1) | (at(node+2) << 8);
+				else             node += type;
+			}
+			else
+			{
+				node += (type == 255) ? 3 : 1;
+			}
+		}
+		if (type == 2) status |= 0x80; // set suffix flag
+	}
+
+	// leaf0 (0 is the only other valid value)
+	if (type != 1 && type != 2) return at(node+1);
+
+	// leaf1, leaf2
+	length = at(node+1);
+	node += 2;
+	--length;
+	return at(node++);
+}
+
+void huffmunch_stream::read(unsigned char* output, unsigned int n)
+{
+	for (uint i=0; i<n; ++i) output[i] = read();
+}
+
+bool huffmunch_configure_ctx(huffmunch_context* ctx, unsigned int parameter, unsigned int value)
 {
 	switch(parameter)
 	{
 	case HUFFMUNCH_SEARCH_WIDTH:
 		if (value < MIN_STEP_SIZE) value = MIN_STEP_SIZE;
-		if (value > MAX_STEP_SIZE) value = MAX_STEP_SIZE;
-		step_size = value;
+		if (value > MAX_SUFFIX_STEP_SIZE) value = MAX_SUFFIX_STEP_SIZE; // hash search is limited to MAX_STEP_SIZE
+		ctx->step_size = value;
+		break;
+	case HUFFMUNCH_SEARCH_SUFFIX:
+		ctx->search_suffix = (value != 0);
+		break;
+	case HUFFMUNCH_WARM_START:
+		ctx->warm_start = (value != 0);
+		ctx->warm_base = 0;
+		ctx->warm_recipes.clear();
+		break;
+	case HUFFMUNCH_THREADS:
+		if (value < 1) value = thread::hardware_concurrency();
+		if (value < 1) value = 1;
+		ctx->thread_count = value;
 		break;
 	case HUFFMUNCH_SEARCH_CUTOFF:
-		cutoff = value;
+		ctx->cutoff = value;
+		break;
+	case HUFFMUNCH_TIME_LIMIT:
+		ctx->time_limit = value;
 		break;
 	case HUFFMUNCH_HEADER_WIDTH:
 		if (value < 1) value = 1;
 		if (value > 4) value = 4;
-		header_width = value;
+		ctx->header_width = value;
 		break;
 	default:
 		return false;
@@ -1276,12 +3085,35 @@ bool huffmunch_configure(unsigned int parameter, unsigned int value)
 	return true;
 }
 
-void huffmunch_debug(unsigned int debug_bits_, int text)
+bool huffmunch_configure(unsigned int parameter, unsigned int value)
+{
+	return huffmunch_configure_ctx(&default_context, parameter, value);
+}
+
+void huffmunch_progress_ctx(huffmunch_context* ctx, huffmunch_progress_callback callback, void* user)
+{
+	ctx->progress = callback;
+	ctx->progress_user = user;
+}
+
+void huffmunch_progress(huffmunch_progress_callback callback, void* user)
+{
+	huffmunch_progress_ctx(&default_context, callback, user);
+}
+
+void huffmunch_debug_ctx(huffmunch_context* ctx, unsigned int debug_bits, int text)
 {
 	#if HUFFMUNCH_DEBUG
-	debug_bits = debug_bits_;
-	debug_text = text;
+	ctx->debug_bits = debug_bits;
+	ctx->debug_text = text;
+	#else
+	(void)ctx; (void)debug_bits; (void)text;
 	#endif
 }
 
+void huffmunch_debug(unsigned int debug_bits, int text)
+{
+	huffmunch_debug_ctx(&default_context, debug_bits, text);
+}
+
 // end of file
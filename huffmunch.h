@@ -14,11 +14,33 @@ const int HUFFMUNCH_VERIFY_FAIL = 2; // internal error: verify failed
 const int HUFFMUNCH_INTERNAL_ERROR = 3; // internal error: use HUFFMUNCH_DEBUG_INTERNAL for diagnostic
 const int HUFFMUNCH_INVALID_SPLITS = 4; // splits must start with 0 and have increasing order
 const int HUFFMUNCH_HEADER_OVERFLOW = 5; // split values overflow header width
+const int HUFFMUNCH_ABORTED = 6; // the progress callback aborted compression
+const int HUFFMUNCH_INVALID_DATA = 7; // data to decompress is not valid huffmunch output
+const int HUFFMUNCH_INVALID_INDEX = 8; // split index to decompress is past the end of the header
 
 // huffmunch_error_description
 //   brief description of the return values above
 extern const char* huffmunch_error_description(int e);
 
+// huffmunch_context
+//   holds the settings and working buffers for compression
+//   separate contexts may be used from separate threads at the same time
+//   each function below has a _ctx version that takes a context as its first argument,
+//   the versions without a context share a default one, and are not thread safe
+struct huffmunch_context;
+
+// huffmunch_context_create
+//   returns a new context with default settings
+extern huffmunch_context* huffmunch_context_create();
+
+// huffmunch_context_destroy
+//   frees a context and its buffers
+extern void huffmunch_context_destroy(huffmunch_context* ctx);
+
+// huffmunch_context_copy_warm
+//   copies the HUFFMUNCH_WARM_START dictionary of src to dst, NULL for the default context
+extern void huffmunch_context_copy_warm(huffmunch_context* dst, const huffmunch_context* src);
+
 // huffmunch_compress
 //   data
 //     data to be compressed
@@ -43,33 +65,148 @@ extern int huffmunch_compress(
 	unsigned int& output_size,
 	const unsigned int *splits,
 	unsigned int split_count);
+extern int huffmunch_compress_ctx(
+	huffmunch_context* ctx,
+	const unsigned char* data,
+	unsigned int data_size,
+	unsigned char* output,
+	unsigned int& output_size,
+	const unsigned int *splits,
+	unsigned int split_count);
 
 // huffmunch_decompress
+//   decodes with a lookup table built from the data's tree, resolving several bits per step
+//   reads data in place and writes directly to output, the table is kept in the context for reuse
+//   uses the HUFFMUNCH_HEADER_WIDTH setting that it was compressed with
 //   data
 //     data to be uncompressed
 //   data_size
 //     length of data to be uncompressed
 //   output
 //     buffer to be filled with decompressed output
+//     if NULL output_size will still be computed
 //   output_size
-//     size of the decompressed output
+//     in: size of buffer to be filled
+//     out: size of the decompressed output
 extern int huffmunch_decompress(
 	const unsigned char* data,
 	unsigned int data_size,
 	unsigned char* output,
 	unsigned int& output_size);
+extern int huffmunch_decompress_ctx(
+	huffmunch_context* ctx,
+	const unsigned char* data,
+	unsigned int data_size,
+	unsigned char* output,
+	unsigned int& output_size);
+
+// huffmunch_decompress_split
+//   decodes only one split, like huffmunch_load in the 6502 runtime
+//   index
+//     index of the split to decode, from 0 to the split count in the header - 1
+//   other arguments are the same as huffmunch_decompress
+extern int huffmunch_decompress_split(
+	const unsigned char* data,
+	unsigned int data_size,
+	unsigned int index,
+	unsigned char* output,
+	unsigned int& output_size);
+extern int huffmunch_decompress_split_ctx(
+	huffmunch_context* ctx,
+	const unsigned char* data,
+	unsigned int data_size,
+	unsigned int index,
+	unsigned char* output,
+	unsigned int& output_size);
+
+// huffmunch_stream
+//   decodes one split a byte at a time, with the same state machine as huffmunch_load/huffmunch_read in huffmunch.s
+//   holds only a few pointers and bytes, like huffmunch_zpblock, and allocates nothing
+//   data is read in place, and must stay valid while the stream is in use
+struct huffmunch_stream
+{
+	// data
+	//   compressed data
+	// data_size
+	//   length of compressed data
+	// header_width
+	//   HUFFMUNCH_HEADER_WIDTH used to compress it
+	huffmunch_stream(const unsigned char* data, unsigned int data_size, unsigned int header_width=2);
+
+	// load
+	//   prepares to read split index from the start
+	//   returns the length of its decompressed data (0 if index is invalid)
+	unsigned int load(unsigned int index);
+
+	// read
+	//   returns the next byte of the split, or decompresses the next n bytes into output
+	//   reading past the end of the split gives undefined bytes, but stays within data
+	unsigned char read();
+	void read(unsigned char* output, unsigned int n);
+
+	// count
+	//   number of splits in the data
+	unsigned int count() const;
+
+private:
+	unsigned char at(const unsigned char* p) const; // 0 outside of data
+
+	const unsigned char* data;
+	const unsigned char* data_end;
+	unsigned char header_width;
+
+	const unsigned char* node; // current node of tree
+	const unsigned char* stream; // next byte of bitstream
+	const unsigned char* tree; // tree base
+	unsigned char byte; // current byte of bitstream
+	unsigned char status; // bits 0-2 = bits left in byte, bit 7 = string with suffix
+	unsigned char length; // bytes left in current string
+};
 
 enum
 {
-	HUFFMUNCH_SEARCH_WIDTH, // maximum symbols to merge per pass, 2-16, default 3
+	HUFFMUNCH_SEARCH_WIDTH, // maximum symbols to merge per pass, 2-16 (2-64 with HUFFMUNCH_SEARCH_SUFFIX), default 3
 	HUFFMUNCH_SEARCH_CUTOFF, // number of retries before concluding search, default 100, 0 unlimited
 	HUFFMUNCH_HEADER_WIDTH, // width of integers in header 1-4, default 2
+	HUFFMUNCH_SEARCH_SUFFIX, // 1 = find repeated strings with a suffix array instead of hashing, default 0
+	HUFFMUNCH_THREADS, // number of threads to evaluate candidates (or decompress splits) in parallel, default 1, 0 = one per CPU
+	HUFFMUNCH_TIME_LIMIT, // milliseconds to search before stopping with the best result so far, default 0 unlimited
+	HUFFMUNCH_WARM_START, // 1 = begin each compression from the dictionary of the previous one, default 0 (setting this clears it)
 };
 
 // huffmunch_configure
 extern bool huffmunch_configure(
 	unsigned int parameter,
 	unsigned int value);
+extern bool huffmunch_configure_ctx(
+	huffmunch_context* ctx,
+	unsigned int parameter,
+	unsigned int value);
+
+// huffmunch_progress_callback
+//   called at the start of each pass of the compression search
+//   best_size
+//     current size of the compressed data in bytes, not including the header
+//   symbols
+//     dictionary symbols added so far
+//   attempts
+//     candidates tried by the previous pass
+//   user
+//     pointer given to huffmunch_progress
+//   returns one of:
+const int HUFFMUNCH_PROGRESS_CONTINUE = 0; // keep searching
+const int HUFFMUNCH_PROGRESS_FINISH = 1; // stop searching, output the best result so far
+const int HUFFMUNCH_PROGRESS_ABORT = 2; // stop without output, huffmunch_compress returns HUFFMUNCH_ABORTED
+typedef int (*huffmunch_progress_callback)(
+	unsigned int best_size,
+	unsigned int symbols,
+	unsigned int attempts,
+	void* user);
+
+// huffmunch_progress
+//   sets a callback for huffmunch_compress to report progress, NULL for none
+extern void huffmunch_progress(huffmunch_progress_callback callback, void* user);
+extern void huffmunch_progress_ctx(huffmunch_context* ctx, huffmunch_progress_callback callback, void* user);
 
 // huffmunch_debug diagnostic bitfield
 const unsigned int HUFFMUNCH_DEBUG_OFF       = 0x00000000UL;
@@ -89,5 +226,6 @@ const unsigned int HUFFMUNCH_DEBUG_FULL      = 0xFFFFFFFFUL;
 //     0 = display symbols as hex
 //    -1 = auto
 extern void huffmunch_debug(unsigned int debug_bits, int text=-1);
+extern void huffmunch_debug_ctx(huffmunch_context* ctx, unsigned int debug_bits, int text=-1);
 
 // end of file
@@ -3,11 +3,17 @@
 // https://github.com/bbbradsmith/huffmunch
 
 #define _CRT_SECURE_NO_WARNINGS
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <map>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 const int VERSION_MAJOR = 1;
@@ -17,39 +23,87 @@ const int VERSION_MINOR = 5;
 
 bool verbose = false;
 unsigned int header_width = 2;
+unsigned int time_limit = 0; // milliseconds for the whole run, 0 for no limit
+std::chrono::steady_clock::time_point time_start;
+unsigned int parallel = 1; // banks attempts to compress at once
+bool optimal = false; // plan all bank splits together instead of filling each bank in turn
+bool warm_start = false; // each compression begins from the dictionary of the last
+unsigned int debug_bits = HUFFMUNCH_DEBUG_OFF;
+int debug_text = -1;
+std::vector<std::pair<unsigned int, unsigned int>> settings; // every huffmunch_configure made, to copy to new contexts
+const char* cache_dir = NULL; // directory for cached list file compression, NULL for none
 
-int huffmunch_file(const char* file_in, const char* file_out)
+void configure(unsigned int parameter, unsigned int value)
 {
-	unsigned char* buffer_in = NULL;
-	unsigned char* buffer_out = NULL;
-	unsigned int size_in = 0;
-	unsigned int size_out = 0;
+	huffmunch_configure(parameter, value);
+	settings.push_back(std::make_pair(parameter, value));
+}
 
-	FILE* f = fopen(file_in, "rb");
-	if (f == NULL)
-	{
-		printf("error: file %s not found\n", file_in);
-		return -1;
-	}
+void debug(unsigned int bits, int text=-1)
+{
+	huffmunch_debug(bits, text);
+	debug_bits = bits;
+	debug_text = text;
+}
+
+// a new context with the same settings as the default one
+huffmunch_context* create_context()
+{
+	huffmunch_context* ctx = huffmunch_context_create();
+	for (auto s : settings) huffmunch_configure_ctx(ctx, s.first, s.second);
+	huffmunch_debug_ctx(ctx, debug_bits, debug_text);
+	return ctx;
+}
+
+// contexts that are destroyed when the list goes out of scope, on every return path
+struct ContextList : public std::vector<huffmunch_context*>
+{
+	~ContextList() { for (huffmunch_context* ctx : *this) huffmunch_context_destroy(ctx); }
+};
+
+// give the next compression whatever remains of the time limit (NULL for the default context)
+void configure_time_limit(huffmunch_context* ctx)
+{
+	if (time_limit == 0) return;
+	using namespace std::chrono;
+	long long elapsed = duration_cast<milliseconds>(steady_clock::now() - time_start).count();
+	long long remain = (long long)time_limit - elapsed;
+	if (remain < 1) remain = 1; // 0 would be unlimited
+	if (ctx) huffmunch_configure_ctx(ctx, HUFFMUNCH_TIME_LIMIT, (unsigned int)remain);
+	else     huffmunch_configure(HUFFMUNCH_TIME_LIMIT, (unsigned int)remain);
+}
+
+// reads a whole file into data with one fread, false if it can't be opened
+bool read_file(const char* path, std::vector<unsigned char>& data)
+{
+	FILE* f = fopen(path, "rb");
+	if (f == NULL) return false;
 	fseek(f,0,SEEK_END);
-	size_in = ftell(f);
-	size_out = size_in + 1024;
+	long size = ftell(f);
 	fseek(f,0,SEEK_SET);
+	data.resize((size > 0) ? size : 0);
+	size_t size_read = data.size() ? fread(data.data(),1,data.size(),f) : 0;
+	fclose(f);
+	data.resize(size_read);
+	return true;
+}
 
-	buffer_in = (unsigned char*)malloc((size_in * 2) + 1024);
-	buffer_out = buffer_in + size_in;
-
-	if (buffer_in == NULL)
+int huffmunch_file(const char* file_in, const char* file_out)
+{
+	std::vector<unsigned char> buffer_in;
+	if (!read_file(file_in, buffer_in))
 	{
-		fclose(f);
-		printf("error: out of memory\n");
+		printf("error: file %s not found\n", file_in);
 		return -1;
 	}
-	fread(buffer_in,1,size_in,f);
-	fclose(f);
+	unsigned int size_in = buffer_in.size();
 	printf("%6d bytes read from %s\n", size_in, file_in);
 
-	int result = huffmunch_compress(buffer_in, size_in, buffer_out, size_out, NULL, 0);
+	unsigned int size_out = size_in + 1024;
+	std::vector<unsigned char> buffer_out(size_out);
+
+	configure_time_limit(NULL);
+	int result = huffmunch_compress(buffer_in.data(), size_in, buffer_out.data(), size_out, NULL, 0);
 	if (result != HUFFMUNCH_OK)
 	{
 		printf("error: compression error %d: %s\n", result, huffmunch_error_description(result));
@@ -60,21 +114,108 @@ int huffmunch_file(const char* file_in, const char* file_out)
 	//       because it's needed by the implementation for convenience,
 	//       even though there is only 1 entry in the output.
 
-	f = fopen(file_out, "wb");
+	FILE* f = fopen(file_out, "wb");
 	if (f == NULL)
 	{
-		free(buffer_in);
 		printf("error: unable to open output file %s\n", file_out);
 		return -1;
 	}
-	fwrite(buffer_out,1,size_out,f);
+	fwrite(buffer_out.data(),1,size_out,f);
 	fclose(f);
 	printf("%6d bytes written to %s\n", size_out, file_out);
-	free(buffer_in);
 
 	return 0;
 }
 
+// FNV-1a 64-bit hash
+uint64_t fnv1a(uint64_t h, const unsigned char* data, unsigned int size)
+{
+	for (unsigned int i=0; i<size; ++i)
+	{
+		h ^= data[i];
+		h *= 0x100000001B3ULL;
+	}
+	return h;
+}
+
+uint64_t fnv1a(uint64_t h, unsigned int v)
+{
+	unsigned char b[4] = { (unsigned char)(v), (unsigned char)(v>>8), (unsigned char)(v>>16), (unsigned char)(v>>24) };
+	return fnv1a(h, b, 4);
+}
+
+// cache file name for a compression of data with splits, into an output buffer of output_size,
+// keyed by the input, splits, and every setting that could change the output
+// (settings are keyed by their final value in parameter order, so argument order doesn't matter)
+std::string cache_file(
+	const unsigned char* data,
+	unsigned int data_size,
+	const unsigned int* splits,
+	unsigned int split_count,
+	unsigned int output_size)
+{
+	uint64_t h = 0xCBF29CE484222325ULL;
+	h = fnv1a(h, VERSION_MAJOR);
+	h = fnv1a(h, VERSION_MINOR);
+	h = fnv1a(h, data_size);
+	h = fnv1a(h, data, data_size);
+	h = fnv1a(h, split_count);
+	for (unsigned int i=0; i<split_count; ++i) h = fnv1a(h, splits[i]);
+	h = fnv1a(h, output_size);
+	std::map<unsigned int, unsigned int> final_settings;
+	for (auto s : settings) final_settings[s.first] = s.second;
+	final_settings.erase(HUFFMUNCH_THREADS); // doesn't change the output
+	for (auto s : final_settings)
+	{
+		h = fnv1a(h, s.first);
+		h = fnv1a(h, s.second);
+	}
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.hfc", (unsigned long long)h);
+	return std::string(cache_dir) + "/" + name;
+}
+
+// cache file format: 4 byte result, 4 byte size, output (only if result is HUFFMUNCH_OK)
+bool cache_read(const std::string& file, unsigned char* output, unsigned int& output_size, int& result)
+{
+	FILE* f = fopen(file.c_str(), "rb");
+	if (f == NULL) return false;
+	unsigned char h[8];
+	bool valid = (fread(h,1,8,f) == 8);
+	unsigned int r = h[0] | (h[1]<<8) | (h[2]<<16) | (h[3]<<24);
+	unsigned int size = h[4] | (h[5]<<8) | (h[6]<<16) | (h[7]<<24);
+	if (valid && r == HUFFMUNCH_OK)
+	{
+		valid = (size <= output_size) && (fread(output,1,size,f) == size);
+	}
+	fclose(f);
+	if (!valid) return false;
+	result = int(r);
+	output_size = size;
+	return true;
+}
+
+void cache_write(const std::string& file, const unsigned char* output, unsigned int output_size, int result)
+{
+	FILE* f = fopen(file.c_str(), "wb");
+	if (f == NULL)
+	{
+		printf("warning: unable to write cache file %s\n", file.c_str());
+		return;
+	}
+	unsigned int h[2] = { (unsigned int)result, output_size };
+	for (unsigned int v : h)
+	{
+		for (unsigned int i=0; i<4; ++i)
+		{
+			fputc(v & 0xFF, f);
+			v >>= 8;
+		}
+	}
+	if (result == HUFFMUNCH_OK) fwrite(output,1,output_size,f);
+	fclose(f);
+}
+
 // helper function for huffmunch_list
 int write_bank_file(
 	unsigned int current_bank,
@@ -203,47 +344,68 @@ int huffmunch_list(const char* list_file, const char* out_file)
 	printf("%d entries read from %s\n", entries.size(), list_file);
 	printf("bank size: %d\n", bank_size);
 
+	// a cache hit skips the compression that would update the warm start dictionary,
+	// so the output would depend on what the cache happened to contain
+	if (cache_dir && warm_start)
+	{
+		printf("warning: cache (-C) is not used with warm start (-W)\n");
+		cache_dir = NULL;
+	}
+
 	// allow "unlimited" banks
 	const unsigned int BANKS_UNLIMITED = 1<<16;
 	if (bank_max < 1) bank_max = BANKS_UNLIMITED;
 
 	// collect data
 
+	// each source file is read whole, once, even if several entries take pieces of it
+	map<string, vector<unsigned char>> sources;
+	size_t data_size = 0;
 	for (unsigned int i=0; i<entries.size(); ++i)
 	{
 		Entry& e = entries[i];
-		splits.push_back(data.size());
 
 		// This is relative to the CWD,
 		// but it would be nice if it was relative to the list file instead,
 		// with the option of using an absolute path.
 		const char* path = e.path.c_str();
-		FILE* fb = fopen(path, "rb");
-		if (fb == NULL)
+		auto source = sources.find(e.path);
+		if (source == sources.end())
 		{
-			printf("error: source file %s not found\n",path);
-			return -1;
+			source = sources.insert(make_pair(e.path, vector<unsigned char>())).first;
+			if (!read_file(path, source->second))
+			{
+				printf("error: source file %s not found\n",path);
+				return -1;
+			}
 		}
-		fseek(fb,0,SEEK_END);
-		long fb_size = ftell(fb);
+		long fb_size = source->second.size();
 
 		int start = (e.start < 0) ? 0 : e.start;
 		int end = (e.end < 0) ? fb_size : e.end;
 		if (start < 0 || end > fb_size)
 		{
 			printf("error: source start and end (%d, %d) out of range for file %s\n",e.start,e.end,path);
-			fclose(fb);
 			return -1;
 		}
-		fseek(fb,e.start,SEEK_SET);
-		for (int i=start; i<end; ++i) data.push_back(fgetc(fb));
-		fclose(fb);
-
 		unsigned int entry_size = end - start;
 		if (end < start) entry_size = 0;
-		if(verbose) printf("%4d: %5d bytes read from %s (%d,%d)\n", i, entry_size, path, e.start, e.end);
 		e.size = entry_size;
+		data_size += entry_size;
 	}
+	data.reserve(data_size);
+	for (unsigned int i=0; i<entries.size(); ++i)
+	{
+		const Entry& e = entries[i];
+		const vector<unsigned char>& source = sources[e.path];
+		// clamped to the source, so an empty entry starting past its end reads nothing
+		const size_t start = min<size_t>((e.start < 0) ? 0 : e.start, source.size());
+		const size_t end = min<size_t>(start + e.size, source.size());
+		splits.push_back(data.size());
+		data.insert(data.end(), source.begin() + start, source.begin() + end);
+		if(verbose) printf("%4d: %5d bytes read from %s (%d,%d)\n", i, e.size, e.path.c_str(), e.start, e.end);
+	}
+	sources.clear();
 	printf("%d bytes read from %d source entries\n", data.size(), entries.size());
 	assert(entries.size() == splits.size());
 
@@ -263,6 +425,203 @@ int huffmunch_list(const char* list_file, const char* out_file)
 	unsigned int last_used = 0;
 	unsigned int last_unused = 0;
 
+	// compress entries start to end-1 into output, result_size is the output buffer size
+	auto compress_entries = [&](huffmunch_context* ctx, unsigned int start, unsigned int end, unsigned char* output, unsigned int& result_size) -> int
+	{
+		unsigned int data_start = splits[start];
+		unsigned int data_end = data.size();
+		if (end < splits.size()) data_end = splits[end];
+
+		vector <unsigned int> temp_splits;
+		for (unsigned int i=start; i<end; ++i)
+			temp_splits.push_back(splits[i] - data_start);
+
+		// reuse the output of an identical compression from an earlier run
+		string cache;
+		if (cache_dir)
+		{
+			int result;
+			cache = cache_file(data.data() + data_start, data_end - data_start, temp_splits.data(), temp_splits.size(), result_size);
+			if (cache_read(cache, output, result_size, result)) return result;
+		}
+
+		configure_time_limit(ctx);
+		int result;
+		if (ctx == NULL) result = huffmunch_compress(
+			data.data() + data_start,
+			data_end - data_start,
+			output, result_size,
+			temp_splits.data(), temp_splits.size());
+		else result = huffmunch_compress_ctx(
+			ctx,
+			data.data() + data_start,
+			data_end - data_start,
+			output, result_size,
+			temp_splits.data(), temp_splits.size());
+
+		// a time limited result depends on how fast it ran, so it isn't kept
+		if (cache_dir && time_limit == 0 && (result == HUFFMUNCH_OK || result == HUFFMUNCH_OUTPUT_OVERFLOW))
+			cache_write(cache, output, result_size, result);
+		return result;
+	};
+
+	// guess the end of a bank that would fill about target bytes
+	auto guess_end = [&](unsigned int start, unsigned int target) -> unsigned int
+	{
+		unsigned int accum = header_width;
+		unsigned int end = start;
+		for (; end < entries.size(); ++end)
+		{
+			accum += (2 * header_width) + entries[end].size;
+			if (accum >= target) break;
+		}
+		return end;
+	};
+
+	// for parallel search, each worker has its own context, and every attempt is kept by its entry range
+	struct Attempt
+	{
+		int result;
+		unsigned int size;
+		vector<unsigned char> output;
+	};
+	map<pair<unsigned int,unsigned int>,Attempt> attempts;
+	ContextList contexts;
+	for (unsigned int i=0; i<parallel && parallel > 1; ++i)
+		contexts.push_back(create_context());
+
+	// with warm start, the sequential search keeps the dictionary of the widest range that fit,
+	// so the next bank begins from the range that was kept instead of the last attempt
+	ContextList fit_warm_holder;
+	if (warm_start) fit_warm_holder.push_back(huffmunch_context_create());
+	huffmunch_context* fit_warm = warm_start ? fit_warm_holder[0] : NULL;
+
+	// compress each (start, end) entry range in jobs, using every worker
+	// (jobs outside the entries are dropped before any are dispatched)
+	auto run_attempts = [&](vector<pair<unsigned int,unsigned int>>& jobs)
+	{
+		jobs.erase(remove_if(jobs.begin(), jobs.end(), [&](const pair<unsigned int,unsigned int>& job)
+		{
+			return job.first >= job.second || job.second > entries.size();
+		}), jobs.end());
+		const unsigned int workers = (contexts.size() > 0) ? contexts.size() : 1;
+		vector<Attempt> results(jobs.size());
+		for (unsigned int j=0; j<jobs.size(); j+=workers)
+		{
+			vector<thread> threads;
+			for (unsigned int i=j; i<jobs.size() && i<(j+workers); ++i)
+			{
+				auto job = [&,i,j]()
+				{
+					Attempt& a = results[i];
+					a.output.resize(bank_size);
+					a.size = bank_size;
+					a.result = compress_entries(contexts.size() ? contexts[i-j] : NULL, jobs[i].first, jobs[i].second, a.output.data(), a.size);
+					a.output.resize((a.result == HUFFMUNCH_OK) ? a.size : 0);
+				};
+				if (contexts.size() > 0) threads.push_back(thread(job));
+				else job();
+			}
+			for (thread& t : threads) t.join();
+		}
+		for (unsigned int i=0; i<jobs.size(); ++i)
+			attempts[jobs[i]] = std::move(results[i]);
+	};
+
+	// optimal partitioning (-O): plan every bank at once with an estimate of each entry's compressed size,
+	// using the fewest banks and then the most even fill, then confirm the plan with real compression.
+	// the estimate is recalibrated from each confirmation until the whole plan fits.
+	vector<unsigned int> plan; // end of each bank
+	if (optimal && bank_max > 1)
+	{
+		const unsigned int PLAN_ATTEMPTS = 8;
+		vector<double> ratio(entries.size(), 0.5); // estimated compressed bytes per input byte of each entry
+		vector<double> ratio_sum(entries.size() + 1); // estimated size of entries 0 to i-1 with their headers
+
+		// update ratio_sum after ratio changes
+		auto accumulate = [&]()
+		{
+			ratio_sum[0] = 0;
+			for (unsigned int i=0; i<entries.size(); ++i)
+				ratio_sum[i+1] = ratio_sum[i] + (2 * header_width) + (entries[i].size * ratio[i]);
+		};
+
+		// estimated size of a bank holding entries start to end-1
+		auto estimate = [&](unsigned int start, unsigned int end) -> double
+		{
+			return header_width + (ratio_sum[end] - ratio_sum[start]);
+		};
+
+		// fill each bank up to fill bytes, returns the end of each bank
+		auto plan_fill = [&](double fill) -> vector<unsigned int>
+		{
+			vector<unsigned int> ends;
+			unsigned int start = 0;
+			while (start < entries.size())
+			{
+				unsigned int end = start + 1; // must store at least 1 entry
+				while (end < entries.size() && estimate(start, end+1) <= fill) ++end;
+				ends.push_back(end);
+				start = end;
+			}
+			return ends;
+		};
+
+		for (unsigned int attempt=0; attempt < PLAN_ATTEMPTS; ++attempt)
+		{
+			// fewest banks, then binary search for the smallest fill that still needs no more banks
+			accumulate();
+			plan = plan_fill(bank_size);
+			const unsigned int bank_count = plan.size();
+			unsigned int fill_lo = 0;
+			unsigned int fill_hi = bank_size;
+			while (fill_lo < fill_hi)
+			{
+				unsigned int fill = (fill_lo + fill_hi) / 2;
+				if (plan_fill(fill).size() <= bank_count) fill_hi = fill;
+				else fill_lo = fill + 1;
+			}
+			plan = plan_fill(fill_hi);
+			if (verbose) printf("Plan %d: %d banks, estimated fill %d bytes\n", attempt, (int)plan.size(), fill_hi);
+
+			// confirm with real compression
+			vector<pair<unsigned int,unsigned int>> jobs;
+			for (unsigned int b=0; b<plan.size(); ++b)
+			{
+				pair<unsigned int,unsigned int> job((b > 0) ? plan[b-1] : 0, plan[b]);
+				if (!attempts.count(job)) jobs.push_back(job);
+			}
+			run_attempts(jobs);
+
+			// recalibrate the estimate from every bank, and check that all of them fit
+			bool fits = true;
+			for (unsigned int b=0; b<plan.size(); ++b)
+			{
+				const unsigned int start = (b > 0) ? plan[b-1] : 0;
+				const Attempt& a = attempts[make_pair(start, plan[b])];
+				if (verbose) printf("Try bank %2d: %3d - %3d (%d bytes)\n", b, start, plan[b], a.size);
+				if (a.result != HUFFMUNCH_OK && a.result != HUFFMUNCH_OUTPUT_OVERFLOW)
+				{
+					printf("error: compression error %d: %s\n", a.result, huffmunch_error_description(a.result));
+					return a.result;
+				}
+				if (a.result != HUFFMUNCH_OK) fits = false;
+
+				double estimated = 0;
+				for (unsigned int i=start; i<plan[b]; ++i)
+					estimated += entries[i].size * ratio[i];
+				double actual = double(a.size) - (header_width * (1 + (2 * (plan[b] - start))));
+				if (estimated > 0 && actual > 0)
+				{
+					for (unsigned int i=start; i<plan[b]; ++i) ratio[i] *= actual / estimated;
+				}
+			}
+			if (fits && plan.size() <= bank_max) break;
+			plan.clear();
+		}
+		if (plan.empty()) printf("Unable to find an optimal partition, using greedy search instead.\n");
+	}
+
 	unsigned int bank_start = 0;
 	while (bank_start < entries.size())
 	{
@@ -284,76 +643,181 @@ int huffmunch_list(const char* list_file, const char* out_file)
 		{
 			// assuming we can fit roughly (banksize x 2) with 50% compression,
 			// use x2 input as a starting estimate
-			unsigned int target = bank_size * 2;
-			unsigned int accum = header_width;
-			for (bank_end = bank_start; bank_end < bank_end_max; ++bank_end)
-			{
-				accum += (2 * header_width) + entries[bank_end].size;
-				if (accum >= target) break;
-			}
+			bank_end = guess_end(bank_start, bank_size * 2);
 			if (bank_end < bank_end_min) bank_end = bank_end_min;
 		}
 
-		// iterative search to find a bank split that fits
 		unsigned int result_size;
-		while (true)
+		if (!plan.empty())
 		{
-			unsigned int data_start = splits[bank_start];
-			unsigned int data_end = data.size();
-			if (bank_end < splits.size()) data_end = splits[bank_end];
+			// already compressed by the optimal partition
+			bank_end = plan[bank_splits.size()];
+			Attempt& a = attempts[make_pair(bank_start,bank_end)];
+			assert(a.result == HUFFMUNCH_OK);
+			result_size = a.size;
+			bank.assign(a.output.begin(), a.output.end());
+		}
+		else if (contexts.size() > 0)
+		{
+			// parallel search: compress the guess and its neighbours at once
+			while (true)
+			{
+				// narrow the range with every attempt already made for this bank,
+				// including those made speculatively while finishing the previous bank
+				// (compressed size is not quite monotonic, so anything beyond a failure is ignored)
+				for (unsigned int e = bank_end_min; e <= bank_end_max; ++e)
+				{
+					auto it = attempts.find(make_pair(bank_start,e));
+					if (it == attempts.end()) continue;
+					const Attempt& a = it->second;
+					if (a.result == HUFFMUNCH_OUTPUT_OVERFLOW)
+					{
+						if (e <= bank_end_min)
+						{
+							printf("error: can't fit entry %d at bank %d. %d compressed bytes > %d\n",
+								bank_start, (int)bank_splits.size(), a.size, bank_size);
+							return -1;
+						}
+						bank_end_max = e - 1;
+					}
+					else if (a.result == HUFFMUNCH_OK)
+					{
+						bank_end_min = e;
+					}
+					else
+					{
+						printf("error: compression error %d: %s\n", a.result, huffmunch_error_description(a.result));
+						return a.result;
+					}
+				}
 
-			assert(bank_end <= bank_end_max);
-			assert(bank_end >= bank_end_min);
+				// successfully found a split for this bank (fits in bank, and has reached our known upper-bound)
+				if (attempts.count(make_pair(bank_start,bank_end_max)) && bank_end_min == bank_end_max)
+				{
+					bank_end = bank_end_max;
+					break;
+				}
 
-			vector <unsigned int> temp_splits;
-			for (unsigned int i=bank_start; i<bank_end; ++i)
-				temp_splits.push_back(splits[i] - data_start);
+				// choose next guess based on the compression ratio of the nearest attempt
+				for (unsigned int d = 0; d < entries.size(); ++d)
+				{
+					auto it = attempts.find(make_pair(bank_start,bank_end+d));
+					if (it == attempts.end() && d <= bank_end) it = attempts.find(make_pair(bank_start,bank_end-d));
+					if (it == attempts.end()) continue;
+					unsigned int data_start = splits[bank_start];
+					unsigned int data_end = data.size();
+					if (it->first.second < splits.size()) data_end = splits[it->first.second];
+					bank_end = guess_end(bank_start, bank_size * (data_end - data_start) / it->second.size);
+					break;
+				}
+				if (bank_end < bank_end_min) bank_end = bank_end_min;
+				if (bank_end > bank_end_max) bank_end = bank_end_max;
 
-			result_size = bank_size;
-			int result = huffmunch_compress(
-				data.data() + data_start,
-				data_end - data_start,
-				bank.data(), result_size,
-				temp_splits.data(), temp_splits.size());
-			if (verbose) printf("Try bank %2d: %3d - %3d (%d bytes)\n",bank_splits.size(),bank_start,bank_end,result_size);
+				// try the untried ends nearest the guess
+				// (with 3 or more workers, one is kept for the next bank)
+				const unsigned int current_jobs = (contexts.size() > 2) ? (contexts.size() - 1) : contexts.size();
+				vector<pair<unsigned int,unsigned int>> jobs;
+				for (unsigned int d = 0; jobs.size() < current_jobs && d <= (bank_end_max - bank_end_min); ++d)
+				{
+					if ((bank_end + d) <= bank_end_max && !attempts.count(make_pair(bank_start,bank_end+d)))
+						jobs.push_back(make_pair(bank_start,bank_end+d));
+					if (d > 0 && (bank_end - d) >= bank_end_min && jobs.size() < current_jobs && !attempts.count(make_pair(bank_start,bank_end-d)))
+						jobs.push_back(make_pair(bank_start,bank_end-d));
+				}
+				assert(jobs.size() > 0);
 
-			// successfully found a split for this bank (fits in bank, and has reached our known upper-bound)
-			if ((bank_end == bank_end_max) && result == HUFFMUNCH_OK) break;
+				// remaining workers start on the next bank, guessing that this one will end at bank_end
+				unsigned int next_start = bank_end;
+				unsigned int next_end = guess_end(next_start, bank_size * 2);
+				if (next_end <= next_start) next_end = next_start + 1;
+				for (unsigned int d = 0; jobs.size() < contexts.size() && next_start < entries.size() && d < entries.size(); ++d)
+				{
+					if ((next_end + d) <= entries.size() && !attempts.count(make_pair(next_start,next_end+d)))
+						jobs.push_back(make_pair(next_start,next_end+d));
+					if (d > 0 && d < (next_end - next_start) && jobs.size() < contexts.size() && !attempts.count(make_pair(next_start,next_end-d)))
+						jobs.push_back(make_pair(next_start,next_end-d));
+				}
 
-			if (result == HUFFMUNCH_OUTPUT_OVERFLOW) // too big
-			{
-				// too much for bank, binary search smaller if possible
-				if (bank_end <= bank_end_min) // nothing left to try, fail
+				run_attempts(jobs);
+				for (unsigned int i=0; i<jobs.size() && verbose; ++i)
 				{
-					printf("error: can't fit entry %d at bank %d. %d compressed bytes > %d\n",
-						bank_start, bank_splits.size(), result_size, bank_size);
-					return -1;
+					printf("Try bank %2d: %3d - %3d (%d bytes)%s\n",
+						(int)bank_splits.size() + ((jobs[i].first == bank_start) ? 0 : 1), jobs[i].first, jobs[i].second, attempts[jobs[i]].size,
+						(jobs[i].first == bank_start) ? "" : " speculative");
 				}
-				bank_end_max = bank_end - 1; // max has to be at least 1 smaller
-			}
-			else if (result == HUFFMUNCH_OK) // fits, but more might be possible
-			{
-				bank_end_min = bank_end; // found a new valid min
-			}
-			else // failure
-			{
-				printf("error: compression error %d: %s\n", result, huffmunch_error_description(result));
-				return result;
 			}
 
-			// choose next guess based on current compression ratio
-			unsigned int target = bank_size * (data_end - data_start) / result_size;
-			unsigned int accum = header_width;
-			unsigned int bank_end_next = bank_start;
-			for (; bank_end_next <= bank_end_max; ++bank_end_next)
+			Attempt& a = attempts[make_pair(bank_start,bank_end)];
+			result_size = a.size;
+			bank.assign(a.output.begin(), a.output.end());
+
+			// attempts starting before the next bank are no longer needed
+			attempts.erase(attempts.begin(), attempts.lower_bound(make_pair(bank_end,0U)));
+		}
+		else
+		{
+			// iterative search to find a bank split that fits
+			// (the widest range that has fit is kept, and never recompressed:
+			//  with a time limit or warm start the same range might not fit again)
+			vector<unsigned char> fit(bank_size);
+			unsigned int fit_size = 0;
+			unsigned int fit_end = 0; // bank_end_min once it has fit
+			while (true)
 			{
-				accum += (2 * header_width) + entries[bank_end_next].size;
-				if (accum >= target) break;
+				unsigned int data_start = splits[bank_start];
+				unsigned int data_end = data.size();
+				if (bank_end < splits.size()) data_end = splits[bank_end];
+
+				assert(bank_end <= bank_end_max);
+				assert(bank_end >= bank_end_min);
+
+				result_size = bank_size;
+				int result = compress_entries(NULL, bank_start, bank_end, bank.data(), result_size);
+				if (verbose) printf("Try bank %2d: %3d - %3d (%d bytes)\n",bank_splits.size(),bank_start,bank_end,result_size);
+
+				// successfully found a split for this bank (fits in bank, and has reached our known upper-bound)
+				if ((bank_end == bank_end_max) && result == HUFFMUNCH_OK) break;
+
+				if (result == HUFFMUNCH_OUTPUT_OVERFLOW) // too big
+				{
+					// too much for bank, binary search smaller if possible
+					if (bank_end <= bank_end_min) // nothing left to try, fail
+					{
+						printf("error: can't fit entry %d at bank %d. %d compressed bytes > %d\n",
+							bank_start, (int)bank_splits.size(), result_size, bank_size);
+						return -1;
+					}
+					bank_end_max = bank_end - 1; // max has to be at least 1 smaller
+					if (fit_end == bank_end_max) // the widest range left has already fit
+					{
+						bank_end = fit_end;
+						bank.swap(fit);
+						result_size = fit_size;
+						if (fit_warm) huffmunch_context_copy_warm(NULL, fit_warm);
+						break;
+					}
+				}
+				else if (result == HUFFMUNCH_OK) // fits, but more might be possible
+				{
+					bank_end_min = bank_end; // found a new valid min
+					fit.swap(bank);
+					fit_size = result_size;
+					fit_end = bank_end;
+					if (fit_warm) huffmunch_context_copy_warm(fit_warm, NULL);
+				}
+				else // failure
+				{
+					printf("error: compression error %d: %s\n", result, huffmunch_error_description(result));
+					return result;
+				}
+
+				// choose next guess based on current compression ratio
+				unsigned int bank_end_next = guess_end(bank_start, bank_size * (data_end - data_start) / result_size);
+				if (bank_end_next < bank_end_min) bank_end_next = bank_end_min;
+				if (bank_end_next > bank_end_max) bank_end_next = bank_end_max;
+				if (bank_end_next == fit_end) bank_end_next += 1; // already fit, don't need to retry it
+				bank_end = bank_end_next;
 			}
-			if (bank_end_next < bank_end_min) bank_end_next = bank_end_min;
-			if (bank_end_next > bank_end_max) bank_end_next = bank_end_max;
-			if (bank_end_next == bank_end) bank_end_next += 1; // in this case, bank_end == bank_end_min, don't need to retry it
-			bank_end = bank_end_next;
 		}
 
 		// success: write the bank
@@ -371,6 +835,8 @@ int huffmunch_list(const char* list_file, const char* out_file)
 		assert(bank_end <= entries.size());
 		bank_start = bank_end;
 	}
+	for (huffmunch_context* ctx : contexts) huffmunch_context_destroy(ctx);
+	contexts.clear();
 
 	// if number of banks is explicit, always generate them all
 	while (bank_max != BANKS_UNLIMITED && bank_splits.size() < bank_max)
@@ -439,8 +905,30 @@ int print_usage()
 		"        Verbose output.\n"
 		"    -S (width)\n"
 		"        Wider search is slower, but marginally increases compression, default 3 (range: 2-16).\n"
+		"    -A\n"
+		"        Search with a suffix array instead of hashing. Slower for narrow searches,\n"
+		"        but better suited to wide ones, and allows -S up to 64.\n"
 		"    -X (cutoff)\n"
 		"        Number of missed attempts before halting compression, default 100, 0 unlimited.\n"
+		"    -T (seconds)\n"
+		"        Stop searching after a time limit, keeping the best compression found so far.\n"
+		"        For a list file the limit is shared by all of its banks. Default 0, unlimited.\n"
+		"    -W\n"
+		"        Warm start: with a list file, begin each attempt to fit a bank\n"
+		"        from the dictionary of the previous attempt. Much faster, but results may vary slightly.\n"
+		"    -O\n"
+		"        With a list file, plan all bank splits together to use the fewest banks\n"
+		"        with the most even fill, instead of filling each bank in turn.\n"
+		"    -C (directory)\n"
+		"        With a list file, cache each compression in this directory,\n"
+		"        and reuse them when the same data and settings are compressed again.\n"
+		"        Compressions with a time limit (-T) are not cached, and warm start (-W) disables it.\n"
+		"    -P (threads)\n"
+		"        With a list file, try several bank splits at once in parallel,\n"
+		"        and start on the next bank while the current one is finishing. Default 1.\n"
+		"    -J (threads)\n"
+		"        Threads to search with in parallel, default 1, 0 for one per CPU.\n"
+		"        Output is the same for any number of threads.\n"
 		"    -H (width)\n"
 		"        Bytes per integer entry in output header, default 2.\n"
 		#if HUFFMUNCH_DEBUG
@@ -481,6 +969,7 @@ int main(int argc, const char** argv)
 	const int MODE_LIST = 1;
 
 	huffmunch_configure(HUFFMUNCH_HEADER_WIDTH, header_width); // just to ensure it matches print_usage()
+	time_start = std::chrono::steady_clock::now();
 
 	bool valid_args = true;
 	for (int i=1; i<argc; ++i)
@@ -497,16 +986,16 @@ int main(int argc, const char** argv)
 				break;
 			case 'd':
 			case 'D':
-				huffmunch_debug(HUFFMUNCH_DEBUG_FULL);
+				debug(HUFFMUNCH_DEBUG_FULL);
 				switch (arg[2])
 				{
 				case 't':
 				case 'T':
-					huffmunch_debug(HUFFMUNCH_DEBUG_FULL,1);
+					debug(HUFFMUNCH_DEBUG_FULL,1);
 					break;
 				case 'b':
 				case 'B':
-					huffmunch_debug(HUFFMUNCH_DEBUG_FULL,0);
+					debug(HUFFMUNCH_DEBUG_FULL,0);
 					break;
 				case 0:
 					break;
@@ -533,19 +1022,61 @@ int main(int argc, const char** argv)
 			case 'S':
 				if (strlen(arg) > 2) valid_args = false;
 				if ((i+1) >= argc) { valid_args = false; break; }
-				huffmunch_configure(HUFFMUNCH_SEARCH_WIDTH, strtoul(argv[i+1],NULL,0)); ++i;
+				configure(HUFFMUNCH_SEARCH_WIDTH, strtoul(argv[i+1],NULL,0)); ++i;
+				break;
+			case 'a':
+			case 'A':
+				if (strlen(arg) > 2) valid_args = false;
+				configure(HUFFMUNCH_SEARCH_SUFFIX, 1);
 				break;
 			case 'x':
 			case 'X':
 				if (strlen(arg) > 2) valid_args = false;
 				if ((i+1) >= argc) { valid_args = false; break; }
-				huffmunch_configure(HUFFMUNCH_SEARCH_CUTOFF, strtoul(argv[i+1],NULL,0)); ++i;
+				configure(HUFFMUNCH_SEARCH_CUTOFF, strtoul(argv[i+1],NULL,0)); ++i;
+				break;
+			case 't':
+			case 'T':
+				if (strlen(arg) > 2) valid_args = false;
+				if ((i+1) >= argc) { valid_args = false; break; }
+				time_limit = (unsigned int)(strtod(argv[i+1],NULL) * 1000.0); ++i;
+				break;
+			case 'w':
+			case 'W':
+				if (strlen(arg) > 2) valid_args = false;
+				configure(HUFFMUNCH_WARM_START, 1);
+				warm_start = true;
+				break;
+			case 'c':
+			case 'C':
+				if (strlen(arg) > 2) valid_args = false;
+				if ((i+1) >= argc) { valid_args = false; break; }
+				cache_dir = argv[i+1]; ++i;
+				break;
+			case 'o':
+			case 'O':
+				if (strlen(arg) > 2) valid_args = false;
+				optimal = true;
+				break;
+			case 'p':
+			case 'P':
+				if (strlen(arg) > 2) valid_args = false;
+				if ((i+1) >= argc) { valid_args = false; break; }
+				parallel = strtoul(argv[i+1],NULL,0); ++i;
+				if (parallel < 1) parallel = std::thread::hardware_concurrency();
+				if (parallel < 1) parallel = 1;
+				break;
+			case 'j':
+			case 'J':
+				if (strlen(arg) > 2) valid_args = false;
+				if ((i+1) >= argc) { valid_args = false; break; }
+				configure(HUFFMUNCH_THREADS, strtoul(argv[i+1],NULL,0)); ++i;
 				break;
 			case 'h':
 			case 'H':
 				if (strlen(arg) > 2) valid_args = false;
 				if ((i+1) >= argc) { valid_args = false; break; }
-				huffmunch_configure(HUFFMUNCH_HEADER_WIDTH, strtoul(argv[i+1],NULL,0)); ++i;
+				configure(HUFFMUNCH_HEADER_WIDTH, strtoul(argv[i+1],NULL,0)); ++i;
 				break;
 			default:
 				valid_args = false;